@@ -13,10 +13,60 @@ from itertools import tee, product
 
 l = GObject.MainLoop()
 
-# Wrapper for dbus api decorator
+# Wrapper for dbus api decorator, byte arrays (the packed transforms of frames) come as bytes
 dec = dbus.service.method(dbus_interface='de.tuberlin.uebb.modelica3d.api',
                           in_signature='a{sv}',
-                          out_signature='s')
+                          out_signature='s',
+                          byte_arrays=True)
+
+# packed transforms, see modbus_wire.h
+OP_TRANSLATION = 0
+OP_ROTATION_MATRIX = 3
+PACKED_KEY = 0x10
+MAX_REFERENCES = 1 << 20
+QUATERNION_SCALE = 2 ** 0.5 * 32767
+
+def varints(data, i, n):
+    values = []
+    for _ in range(n):
+        v = shift = 0
+        while True:
+            b = data[i]
+            i += 1
+            v |= (b & 0x7f) << shift
+            shift += 7
+            if b < 0x80:
+                break
+        values.append(v)
+    return values, i
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+def quaternion_matrix(dropped, q):
+    c = [v / QUATERNION_SCALE for v in q]
+    c.insert(dropped, max(0.0, 1.0 - sum(v * v for v in c)) ** 0.5)
+    w, x, y, z = c
+    return [1 - 2 * (y * y + z * z), 2 * (x * y - w * z), 2 * (x * z + w * y),
+            2 * (x * y + w * z), 1 - 2 * (x * x + z * z), 2 * (y * z - w * x),
+            2 * (x * z - w * y), 2 * (y * z + w * x), 1 - 2 * (x * x + y * y)]
+
+# frames also get the bus name of their sender, packed transforms are relative to its earlier frames
+def frame_api(f):
+    nf = lambda s, p={}, sender=None : f(s, sender=sender, **p)
+    nf.__name__ = f.__name__
+    return dbus.service.method(dbus_interface='de.tuberlin.uebb.modelica3d.api',
+                               in_signature='a{sv}',
+                               out_signature='s',
+                               byte_arrays=True,
+                               sender_keyword='sender')(nf)
+
+# typed fast paths, their arguments come as one struct. Shapes reach them when a ring has
+# neither shared memory nor a frame to write to (modbus_ring_add), and so do direct API users
+def typed(signature):
+    return dbus.service.method(dbus_interface='de.tuberlin.uebb.modelica3d.api',
+                               in_signature=signature,
+                               out_signature='s')
 
 # decorate a function with optional typechecks
 def mod3D_api(**checks):
@@ -144,6 +194,51 @@ class Modelica3DAPI(dbus.service.Object):
         context.active_object.name = reference
         return reference
 
+    # parametric shapes are approximated by their envelope, a length change scales it along z
+
+    @mod3D_api(reference = undefined_object)
+    def make_spring(self, reference, x=0.0, y=0.0, z=1.0, length=1.0, width=0.1, height=0.01, extra=5):
+        ops.mesh.primitive_cylinder_add(radius=width / 2.0, depth=length)
+        context.active_object.name = reference
+        self.lengths[reference] = length
+        return reference
+
+    @mod3D_api(reference = undefined_object)
+    def make_pipe(self, reference, x=0.0, y=0.0, z=1.0, length=1.0, width=0.1, extra=0.5):
+        ops.mesh.primitive_cylinder_add(radius=width / 2.0, depth=length)
+        context.active_object.name = reference
+        self.lengths[reference] = length
+        return reference
+
+    @mod3D_api(reference = undefined_object)
+    def make_gearwheel(self, reference, x=0.0, y=0.0, z=1.0, length=0.1, width=1.0, extra=20):
+        ops.mesh.primitive_cylinder_add(vertices=max(3, int(abs(extra))) * 2, radius=width / 2.0, depth=length)
+        context.active_object.name = reference
+        self.lengths[reference] = length
+        return reference
+
+    @mod3D_api(reference = defined_object, frame = positive_int)
+    def set_shape_parameter(self, reference, parameter, value, frame=1):
+        if parameter != "length" or not self.lengths.get(reference):
+            return reference
+        o = data.objects[reference]
+        context.scene.frame_set(frame=frame)
+        o.scale.z = value / self.lengths[reference]
+        o.keyframe_insert('scale', frame=frame)
+        return reference
+
+    @mod3D_api(reference = undefined_object)
+    def make_group(self, reference):
+        # an empty, its children are placed relative to it
+        ops.object.add(type='EMPTY')
+        context.active_object.name = reference
+        return reference
+
+    @mod3D_api(reference = defined_object, group = defined_object)
+    def add_to_group(self, reference, group):
+        data.objects[reference].parent = data.objects[group]
+        return reference
+
     @mod3D_api()
     def load_scene(self, filepath):
       with data.libraries.load(filepath) as (src, _):
@@ -173,6 +268,85 @@ class Modelica3DAPI(dbus.service.Object):
         o.keyframe_insert('rotation_euler', frame=frame)
         return reference
 
+    @typed('(sdddd)')
+    def set_translation(self, args):
+        reference, x, y, z, t = args
+        return self.move_to({'reference' : reference, 'x' : x, 'y' : y, 'z' : z, 'frame' : self.frame_of(t)})
+
+    @typed('(sdddd)')
+    def set_scale(self, args):
+        reference, x, y, z, t = args
+        return self.scale({'reference' : reference, 'x' : x, 'y' : y, 'z' : z, 'frame' : self.frame_of(t)})
+
+    @typed('(sadd)')
+    def set_rotation_matrix(self, args):
+        reference, R, t = args
+        p = dict(("R_%d_%d" % (i // 3 + 1, i % 3 + 1), R[i]) for i in range(9))
+        p.update(reference=reference, frame=self.frame_of(t))
+        return self.rotate(p)
+
+    def frame_of(self, t):
+        return int(round(t * context.scene.render.fps)) + 1
+
+    def unpacked(self, data, quantum, stream):
+        # the packed transforms of a frame as (reference, op, values), the last values
+        # of every reference number are kept in self.packed by (sender, stream)
+        bodies = self.packed.setdefault(stream, {})
+        records = []
+        i = 0
+        while i < len(data):
+            (number,), i = varints(data, i, 1)
+            header = data[i]
+            i += 1
+            op, key, dropped = header & 0x0f, header & PACKED_KEY, (header >> 5) & 3
+            if number >= MAX_REFERENCES:
+                raise ValueError("reference number %d" % number)
+            body = bodies.setdefault(number, {})
+            if key:
+                (length,), i = varints(data, i, 1)
+                reference = data[i:i + length].decode()
+                # the writer may have given the number to another reference, the old values are not its
+                if body.get('reference') != reference:
+                    body.clear()
+                    body['reference'] = reference
+                i += length
+            deltas, i = varints(data, i, 3)
+            last = body.get(op)
+            if not key and last is None:
+                continue
+            body[op] = last = [(0 if key else last[k]) + unzigzag(deltas[k]) for k in range(3)]
+            if op == OP_TRANSLATION:
+                records.append((body['reference'], "translation", [v * quantum for v in last]))
+            elif op == OP_ROTATION_MATRIX:
+                records.append((body['reference'], "rotation_matrix", quaternion_matrix(dropped, last)))
+        return records
+
+    @frame_api
+    def frame(self, sender=None, t=0.0, records=[], quantum=0.0, packed=None, stream=0):
+        # the updates of one time step as (reference, op, values), see the osg-gtk server
+        frame = self.frame_of(t)
+        if packed:
+            try:
+                records = list(records) + self.unpacked(packed, quantum, (sender, stream))
+            except (IndexError, ValueError):
+                # an error reply makes the sender start over with key records
+                raise dbus.exceptions.DBusException("bad packed transforms")
+        for reference, op, values in records:
+            p = {'reference' : reference, 'frame' : frame}
+            if op == "translation":
+                p.update(x=values[0], y=values[1], z=values[2])
+                self.move_to(p)
+            elif op == "scale":
+                p.update(x=values[0], y=values[1], z=values[2])
+                self.scale(p)
+            elif op == "rotation_matrix":
+                p.update(("R_%d_%d" % (i // 3 + 1, i % 3 + 1), values[i]) for i in range(9))
+                self.rotate(p)
+            elif op == "shape_parameter":
+                p.update(parameter=["length", "width", "height", "extra"][int(values[0])], value=values[1])
+                self.set_shape_parameter(p)
+        return "frame"
+
 if __name__ == '__main__':
     # delete default cube
     if 'Cube' in data.objects:
@@ -182,4 +356,6 @@ if __name__ == '__main__':
     session_bus = dbus.SessionBus()
     name = dbus.service.BusName("de.tuberlin.uebb.modelica3d.server", session_bus)
     api = Modelica3DAPI(session_bus, "/de/tuberlin/uebb/modelica3d/server")    
+    api.lengths = {}
+    api.packed = {}
     l.run()
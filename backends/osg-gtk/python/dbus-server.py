@@ -33,6 +33,25 @@ elif (platform.system() == 'Darwin'):
 
 viewer.osg_gtk_alloc_context.restype = c_void_p
 
+# see proc3d_stats in proc3d.hpp
+OP_TYPES = ["translation", "scale", "rotation_euler", "rotation_matrix", "material_property",
+            "ambient_color", "diffuse_color", "specular_color", "shape_parameter"]
+
+# see proc3d_shape_parameter in proc3d.hpp
+SHAPE_PARAMETERS = {"length": 0, "width": 1, "height": 2, "extra": 3}
+
+class Stats(Structure):
+    _fields_ = [("delta_ops", c_ulonglong * len(OP_TYPES)),
+                ("total_delta_ops", c_ulonglong),
+                ("objects", c_ulonglong),
+                ("setup_ops", c_ulonglong),
+                ("keyframes", c_ulonglong),
+                ("timeline_ops", c_ulonglong),
+                ("bytes", c_ulonglong),
+                ("peak_bytes", c_ulonglong),
+                ("ops_per_second", c_double),
+                ("average_ops_per_second", c_double)]
+
 from dbus.mainloop.glib import DBusGMainLoop
 import dbus
 import dbus.service
@@ -46,10 +65,28 @@ else:
   from gi.repository import GObject
   l = GObject.MainLoop()
 
-# Wrapper for dbus api decorator
+# Wrapper for dbus api decorator, byte arrays (the packed transforms of frames) come as strings
 dec = dbus.service.method(dbus_interface='de.tuberlin.uebb.modelica3d.api',
                           in_signature='a{sv}',
-                          out_signature='s')
+                          out_signature='s',
+                          byte_arrays=True)
+
+# frames also get the bus name of their sender, packed transforms are relative to its earlier frames
+def frame_api(f):
+    nf = lambda s, p={}, sender=None : f(s, sender=sender, **p)
+    nf.__name__ = f.__name__
+    return dbus.service.method(dbus_interface='de.tuberlin.uebb.modelica3d.api',
+                               in_signature='a{sv}',
+                               out_signature='s',
+                               byte_arrays=True,
+                               sender_keyword='sender')(nf)
+
+# typed fast paths, their arguments come as one struct. Shapes reach them when a ring has
+# neither shared memory nor a frame to write to (modbus_ring_add), and so do direct API users
+def typed(signature):
+    return dbus.service.method(dbus_interface='de.tuberlin.uebb.modelica3d.api',
+                               in_signature=signature,
+                               out_signature='s')
 
 # decorate a function with optional typechecks
 def mod3D_api(**checks):
@@ -100,47 +137,126 @@ def existing_file(x):
 
 class Modelica3DAPI(dbus.service.Object):
 
+    # creation returns a handle, remember it so that hot ops skip the name lookup
+    def handle(self, reference):
+        h = self.handles.get(reference)
+        if h is None:
+            h = self.handles[reference] = self.omg.proc3d_get_handle(self.ctxt, c_char_p(reference))
+        return c_uint(h)
+
     @mod3D_api()
     def stop(self):
         # Quit the dbus server
         l.quit()
         return "stopped"
 
+    @mod3D_api()
+    def attach_ring(self, path):
+        # a local simulation streams its delta ops through shared memory, answering with the path accepts
+        if self.omg.proc3d_attach_ring(self.ctxt, c_char_p(path)) != 0:
+            return "cannot attach %s" % path
+        return path
+
+    @mod3D_api()
+    def set_decimation(self, position=0.0, angle=0.0):
+        self.omg.proc3d_set_decimation(self.ctxt, c_double(position), c_double(angle))
+        return "decimation"
+
+    @mod3D_api()
+    def set_retention(self, seconds=0.0):
+        self.omg.proc3d_set_retention(self.ctxt, c_double(seconds))
+        return "retention"
+
+    @mod3D_api(hottest = positive_int)
+    def stats(self, hottest=5):
+        # counters of the context, one "key value" pair per line
+        st = Stats()
+        self.omg.proc3d_context_stats(self.ctxt, byref(st))
+        lines = ["%s %d" % (f, getattr(st, f)) for f, _ in Stats._fields_[1:8]]
+        lines += ["%s %.1f" % (f, getattr(st, f)) for f, _ in Stats._fields_[8:]]
+        lines += ["ops.%s %d" % (op, st.delta_ops[i]) for i, op in enumerate(OP_TYPES)]
+
+        handles = (c_uint * hottest)()
+        counts = (c_ulonglong * hottest)()
+        n = self.omg.proc3d_hottest_objects(self.ctxt, c_int(hottest), handles, counts)
+        names = dict((int(h), r) for r, h in self.handles.items())
+        lines += ["hot.%s %d" % (names.get(handles[i], str(handles[i])), counts[i]) for i in range(n)]
+        return "\n".join(lines)
+
     @mod3D_api(reference = undefined_object, length = not_zero)
     def make_box(self, reference, length=1, width=1, height=1, tx=0.0, ty=0.0, tz=1.0):
-        self.omg.proc3d_create_box(self.ctxt, c_char_p(reference),
+        self.handles[reference] = self.omg.proc3d_create_box(self.ctxt, c_char_p(reference),
                                    c_double(tx), c_double(ty), c_double(tz),
                                    c_double(width), c_double(length), c_double(height))
         return reference
 
     @mod3D_api(reference = undefined_object, height = not_zero, diameter = not_zero)
     def make_cone(self, reference, x=0.0, y=0.0, z=1.0, diameter=1, height=5):
-        self.omg.proc3d_create_cone(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z), c_double(height), c_double(diameter / 2.0));
+        self.handles[reference] = self.omg.proc3d_create_cone(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z), c_double(height), c_double(diameter / 2.0));
         return reference
 
     @mod3D_api(reference = undefined_object, size = not_zero)
     def make_sphere(self, reference, size=1):
-        self.omg.proc3d_create_sphere(self.ctxt, c_char_p(reference), c_double(size / 2.0));
+        self.handles[reference] = self.omg.proc3d_create_sphere(self.ctxt, c_char_p(reference), c_double(size / 2.0));
         return reference
 
     @mod3D_api(reference = undefined_object, height = not_zero, diameter = not_zero)
     def make_cylinder(self, reference, x=0.0, y=0.0, z=1.0, diameter=1, height = 10):
-        self.omg.proc3d_create_cylinder(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z), c_double(height), c_double(diameter / 2.0))
+        self.handles[reference] = self.omg.proc3d_create_cylinder(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z), c_double(height), c_double(diameter / 2.0))
+        return reference
+
+    @mod3D_api(reference = undefined_object, length = not_zero, width = not_zero)
+    def make_spring(self, reference, x=0.0, y=0.0, z=1.0, length=1, width=0.1, height=0.01, extra=5):
+        # width is the diameter of the coil, height that of the wire and extra the number of windings
+        self.handles[reference] = self.omg.proc3d_create_spring(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z),
+                                   c_double(length), c_double(width), c_double(height), c_double(extra))
+        return reference
+
+    @mod3D_api(reference = undefined_object, length = not_zero, width = not_zero)
+    def make_pipe(self, reference, x=0.0, y=0.0, z=1.0, length=1, width=0.1, extra=0.5):
+        # extra is the inner diameter relative to width
+        self.handles[reference] = self.omg.proc3d_create_pipe(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z),
+                                   c_double(length), c_double(width), c_double(extra))
+        return reference
+
+    @mod3D_api(reference = undefined_object, length = not_zero, width = not_zero)
+    def make_gearwheel(self, reference, x=0.0, y=0.0, z=1.0, length=0.1, width=1, extra=20):
+        # extra is the number of teeth
+        self.handles[reference] = self.omg.proc3d_create_gearwheel(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z),
+                                   c_double(length), c_double(width), c_double(extra))
+        return reference
+
+    @mod3D_api(reference = defined_object)
+    def set_shape_parameter(self, reference, parameter, value, t=0.0):
+        if parameter not in SHAPE_PARAMETERS:
+            return "unknown shape parameter %s" % parameter
+        self.omg.proc3d_set_shape_parameter_by_handle(self.ctxt, self.handle(reference), c_int(SHAPE_PARAMETERS[parameter]), c_double(value), c_double(t))
+        return reference
+
+    @mod3D_api(reference = undefined_object)
+    def make_group(self, reference):
+        # members are placed relative to the group, moving it moves all of them
+        self.handles[reference] = self.omg.proc3d_create_group(self.ctxt, c_char_p(reference))
+        return reference
+
+    @mod3D_api(reference = defined_object, group = defined_object)
+    def add_to_group(self, reference, group):
+        self.omg.proc3d_add_to_group(self.ctxt, c_char_p(reference), c_char_p(group))
         return reference
 
     @mod3D_api(reference = defined_object)
     def move_to(self, reference, x=0.0, y=0.0, z=0.0, t=0.0, immediate=False):
-        self.omg.proc3d_set_translation(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z), c_double(t));
+        self.omg.proc3d_set_translation_by_handle(self.ctxt, self.handle(reference), c_double(x), c_double(y), c_double(z), c_double(t));
         return reference
 
     @mod3D_api(reference = defined_object)
     def scale(self, reference, x=0.0, y=0.0, z=0.0, t=0.0, immediate=False):
-        self.omg.proc3d_set_scale(self.ctxt, c_char_p(reference), c_double(x), c_double(y), c_double(z), c_double(t))
+        self.omg.proc3d_set_scale_by_handle(self.ctxt, self.handle(reference), c_double(x), c_double(y), c_double(z), c_double(t))
         return reference
 
     @mod3D_api(reference = undefined_material)
     def make_material(self, reference):
-        self.omg.proc3d_create_material(self.ctxt, c_char_p(reference))
+        self.handles[reference] = self.omg.proc3d_create_material(self.ctxt, c_char_p(reference))
         return reference
 
     @mod3D_api(reference = defined_object, material=defined_material)
@@ -155,17 +271,17 @@ class Modelica3DAPI(dbus.service.Object):
 
     @mod3D_api(reference = defined_material)
     def set_ambient_color(self, reference, r=0.5, g=0.5, b=0.5, a=0, immediate=True, t=0.0):
-        self.omg.proc3d_set_ambient_color(self.ctxt, c_char_p(reference), c_double(r), c_double(g) , c_double(b) , c_double(a), c_double(t))
+        self.omg.proc3d_set_ambient_color_by_handle(self.ctxt, self.handle(reference), c_double(r), c_double(g) , c_double(b) , c_double(a), c_double(t))
         return reference
 
     @mod3D_api(reference = defined_material)
     def set_diffuse_color(self, reference, r=0.5, g=0.5, b=0.5, a=0, immediate=True, t=0.0):
-        self.omg.proc3d_set_diffuse_color(self.ctxt, c_char_p(reference), c_double(r), c_double(g) , c_double(b) , c_double(a), c_double(t))
+        self.omg.proc3d_set_diffuse_color_by_handle(self.ctxt, self.handle(reference), c_double(r), c_double(g) , c_double(b) , c_double(a), c_double(t))
         return reference
 
     @mod3D_api(reference = defined_material)
     def set_specular_color(self, reference, r=0.5, g=0.5, b=0.5, a=0, immediate=True, t=0.0):
-        self.omg.proc3d_set_specular_color(self.ctxt, c_char_p(reference), c_double(r), c_double(g) , c_double(b) , c_double(a), c_double(t))
+        self.omg.proc3d_set_specular_color_by_handle(self.ctxt, self.handle(reference), c_double(r), c_double(g) , c_double(b) , c_double(a), c_double(t))
         return reference
 
     @mod3D_api(reference = defined_object)
@@ -174,16 +290,63 @@ class Modelica3DAPI(dbus.service.Object):
                R_2_1, R_2_2, R_2_3,
                R_3_1, R_3_2, R_3_3,
                t=0.0):
-        self.omg.proc3d_set_rotation_matrix(self.ctxt, c_char_p(reference),
+        self.omg.proc3d_set_rotation_matrix_by_handle(self.ctxt, self.handle(reference),
                   c_double(R_1_1), c_double(R_1_2), c_double(R_1_3),
                   c_double(R_2_1), c_double(R_2_2), c_double(R_2_3),
                   c_double(R_3_1), c_double(R_3_2), c_double(R_3_3),
                   c_double(t))
         return reference
 
+    @frame_api
+    def frame(self, sender=None, t=0.0, records=[], quantum=0.0, packed=None, stream=0):
+        # the updates of one time step, every record is (reference, op, values) with
+        # op one of OP_TYPES, rotation matrices row major and shape parameters as (parameter, value),
+        # translations and rotations may come packed instead (see modbus_wire.h)
+        if packed and self.omg.proc3d_apply_packed(self.ctxt, c_char_p(str(sender or "")), c_int(stream), c_double(t), c_double(quantum),
+                                                   c_char_p(packed), c_int(len(packed))) != 0:
+            # an error reply makes the sender start over with key records
+            raise dbus.exceptions.DBusException("bad packed transforms")
+        d = lambda i: c_double(values[i])
+        for reference, op, values in records:
+            h = self.handle(reference)
+            if op == "translation":
+                self.omg.proc3d_set_translation_by_handle(self.ctxt, h, d(0), d(1), d(2), c_double(t))
+            elif op == "rotation_matrix":
+                self.omg.proc3d_set_rotation_matrix_by_handle(self.ctxt, h, *([d(i) for i in range(9)] + [c_double(t)]))
+            elif op == "scale":
+                self.omg.proc3d_set_scale_by_handle(self.ctxt, h, d(0), d(1), d(2), c_double(t))
+            elif op == "rotation_euler":
+                self.omg.proc3d_set_rotation_euler_by_handle(self.ctxt, h, d(0), d(1), d(2), c_double(t))
+            elif op == "shape_parameter":
+                self.omg.proc3d_set_shape_parameter_by_handle(self.ctxt, h, c_int(int(values[0])), d(1), c_double(t))
+            elif op in ("ambient_color", "diffuse_color", "specular_color"):
+                getattr(self.omg, "proc3d_set_%s_by_handle" % op)(self.ctxt, h, d(0), d(1), d(2), d(3), c_double(t))
+            else:
+                return "unknown op %s" % op
+        return "frame"
+
+    @typed('(sdddd)')
+    def set_translation(self, args):
+        reference, x, y, z, t = args
+        self.omg.proc3d_set_translation_by_handle(self.ctxt, self.handle(reference), c_double(x), c_double(y), c_double(z), c_double(t))
+        return reference
+
+    @typed('(sdddd)')
+    def set_scale(self, args):
+        reference, x, y, z, t = args
+        self.omg.proc3d_set_scale_by_handle(self.ctxt, self.handle(reference), c_double(x), c_double(y), c_double(z), c_double(t))
+        return reference
+
+    @typed('(sadd)')
+    def set_rotation_matrix(self, args):
+        reference, R, t = args
+        # R holds the 9 values row major
+        self.omg.proc3d_set_rotation_matrix_by_handle(self.ctxt, self.handle(reference), *([c_double(r) for r in R] + [c_double(t)]))
+        return reference
+
     @mod3D_api(reference = undefined_object, fileName = existing_file)
     def loadFromFile(self, reference, fileName, tx=0.0, ty=0.0, tz=1.0):
-        self.omg.proc3d_load_object(self.ctxt, c_char_p(reference), c_char_p(fileName),
+        self.handles[reference] = self.omg.proc3d_load_object(self.ctxt, c_char_p(reference), c_char_p(fileName),
                                    c_double(tx), c_double(ty), c_double(tz))
         return reference
 
@@ -196,10 +359,22 @@ if __name__ == '__main__':
     ctxt = c_void_p(viewer.osg_gtk_alloc_context())
     api.omg = proc3d
     api.ctxt = ctxt
+    api.handles = {}
+
+    # with a memory budget (MB), the recording is streamed to disk while the simulation runs
+    if len(sys.argv) > 2:
+        if proc3d.proc3d_spill_to(ctxt, c_char_p(sys.argv[1]), c_double(float(sys.argv[2]))) != 0:
+            print("Cannot stream to %s" % sys.argv[1])
+            sys.exit(1)
 
     print("Running dbus-server...")
     l.run()
     print("dbus server finished.")
 
+    # optionally keep the animation for later replay with the viewer
+    if len(sys.argv) > 1:
+        if proc3d.proc3d_save_recording(ctxt, c_char_p(sys.argv[1])) == 0:
+            print("Recording written to %s" % sys.argv[1])
+
     proc3d.proc3d_send_signal(ctxt, 1) # run viewer
     viewer.osg_gtk_free_context(ctxt)
@@ -34,36 +34,197 @@
 #include <osg/Program>
 #include <osg/Shader>
 
+#include <sstream>
+#include <string>
+
 #include "operations.hpp"
+#include "nameRegistry.hpp"
+#include "trackStore.hpp"
+#include "parametric_shapes.hpp"
 
 using namespace proc3d;
 using namespace osg;
 
+/* the colors of a material */
+struct material_colors {
+  Vec4d ambient, diffuse, specular;
+
+  material_colors() {
+    const ref_ptr<Material> defaults = new Material();
+    ambient = defaults->getAmbient(Material::FRONT);
+    diffuse = defaults->getDiffuse(Material::FRONT);
+    specular = defaults->getSpecular(Material::FRONT);
+  }
+
+  bool operator<(const material_colors& other) const {
+    if (ambient != other.ambient) return ambient < other.ambient;
+    if (diffuse != other.diffuse) return diffuse < other.diffuse;
+    return specular < other.specular;
+  }
+};
+
+/*
+  A material of the model. Most models use a handful of colors for many
+  materials, so all materials with the same colors share one StateSet.
+  Changing the colors of a material never touches the shared state, the
+  material and its nodes move to the StateSet of the new colors instead.
+ */
+struct logical_material : public Referenced {
+  material_colors colors;
+  ref_ptr<StateSet> state;		// shared, NULL until applied
+  std::vector<ref_ptr<Node>> nodes;	// the nodes it was applied to
+};
+
 typedef std::map<std::string, ref_ptr<PositionAttitudeTransform>> t_node_cache;
-typedef std::map<std::string, ref_ptr<Material>> t_material_cache;
+typedef std::map<std::string, ref_ptr<logical_material>> t_material_cache;
+
+/* the shared StateSet of every color combination in use */
+typedef std::map<material_colors, ref_ptr<StateSet>> t_material_states;
+
+/* the geometry of the parametric shapes, by object name */
+typedef std::map<std::string, ref_ptr<ParametricShape>> t_shape_cache;
+
+/* handle indexed views of the caches, used for delta ops */
+typedef std::vector<ref_ptr<PositionAttitudeTransform>> t_node_table;
+typedef std::vector<ref_ptr<logical_material>> t_material_table;
+typedef std::vector<ref_ptr<ParametricShape>> t_shape_table;
 
 struct proc3d_osg_interpreter : boost::static_visitor<> {
 private:
   const ref_ptr<Group> root;
+  const NameRegistry& registry;
 public:
   t_node_cache& node_cache;
   t_material_cache& material_cache;
+  t_node_table& node_table;
+  t_material_table& material_table;
+  t_material_states& material_states;
+  t_shape_cache& shape_cache;
+  t_shape_table& shape_table;
+
+  proc3d_osg_interpreter(const ref_ptr<Group> r, const NameRegistry& n, t_node_cache& c, t_material_cache& m,
+			 t_node_table& ct, t_material_table& mt, t_material_states& ms,
+			 t_shape_cache& sc, t_shape_table& st) :
+    root(r), registry(n), node_cache(c), material_cache(m), node_table(ct), material_table(mt), material_states(ms),
+    shape_cache(sc), shape_table(st) {}
+
+  /* fill the handle tables from the name caches, call after all setup ops */
+  void resolve_handles() const {
+    node_table.assign(registry.size(), ref_ptr<PositionAttitudeTransform>());
+    material_table.assign(registry.size(), ref_ptr<logical_material>());
+    shape_table.assign(registry.size(), ref_ptr<ParametricShape>());
+
+    for (object_handle h = 0; h < registry.size(); h++) {
+      const t_node_cache::const_iterator node = node_cache.find(registry.name(h).to_string());
+      if (node != node_cache.end())
+	node_table[h] = node->second;
+
+      const t_material_cache::const_iterator mat = material_cache.find(registry.name(h).to_string());
+      if (mat != material_cache.end())
+	material_table[h] = mat->second;
+
+      const t_shape_cache::const_iterator shape = shape_cache.find(registry.name(h).to_string());
+      if (shape != shape_cache.end())
+	shape_table[h] = shape->second;
+    }
+  }
 
-  proc3d_osg_interpreter(const ref_ptr<Group> r, t_node_cache& c, t_material_cache& m) :
-    root(r), node_cache(c), material_cache(m) {}
+  /* for messages, h may come from a client that never created it */
+  std::string name_of(const object_handle h) const {
+    if (h < registry.size())
+      return registry.name(h).to_string();
+    std::ostringstream s;
+    s << "handle " << h;
+    return s.str();
+  }
+
+  PositionAttitudeTransform* find_node(const object_handle h) const {
+    if (h >= node_table.size() || !node_table[h].valid()) {
+      std::cout << "Inconsistent naming. Did not find " << name_of(h) << std::endl;
+      return NULL;
+    }
+    return node_table[h].get();
+  }
 
+  logical_material* find_material(const object_handle h) const {
+    if (h >= material_table.size() || !material_table[h].valid()) {
+      std::cout << "Inconsistent naming. Did not find material: " << name_of(h) << std::endl;
+      return NULL;
+    }
+    return material_table[h].get();
+  }
+
+  /* a group is an empty transform, the transforms of its members are relative to it */
   void operator()(const CreateGroup& cmd) const {
+    const ref_ptr<PositionAttitudeTransform> trans =
+      new PositionAttitudeTransform();
+    trans->setName(cmd.name);
 
+    node_cache[cmd.name] = trans;
+    root->addChild(trans);
   }
 
+  /* move object name (a shape or another group) from its current parent into group target */
   void operator()(const AddToGroup& cmd) const {
+    const t_node_cache::const_iterator node = node_cache.find(cmd.name);
+    if (node == node_cache.end()) {
+      std::cout << "Inconsistent naming. Did not find " << cmd.name << std::endl;
+      return;
+    }
 
+    const t_node_cache::const_iterator group = node_cache.find(cmd.target);
+    if (group == node_cache.end()) {
+      std::cout << "Inconsistent naming. Did not find group: " << cmd.target << std::endl;
+      return;
+    }
+
+    /* the group must not end up below the node itself */
+    for (Node* n = group->second.get(); n; n = n->getNumParents() ? n->getParent(0) : NULL) {
+      if (n == node->second.get()) {
+	std::cout << "Cannot add " << cmd.name << " to its own member " << cmd.target << std::endl;
+	return;
+      }
+    }
+
+    const ref_ptr<PositionAttitudeTransform> child = node->second;
+    while (child->getNumParents())
+      child->getParent(0)->removeChild(child.get());
+    group->second->addChild(child.get());
+  }
+
+  /* the shared StateSet for colors, created on first use */
+  StateSet* state_for(const material_colors& colors) const {
+    ref_ptr<StateSet>& state = material_states[colors];
+    if (!state.valid()) {
+      const ref_ptr<Material> mat = new Material();
+      mat->setAmbient(Material::FRONT, colors.ambient);
+      mat->setDiffuse(Material::FRONT, colors.diffuse);
+      mat->setSpecular(Material::FRONT, colors.specular);
+
+      state = new StateSet();
+      state->setAttribute(mat.get());
+    }
+    return state.get();
+  }
+
+  /* copy on write: move mat and its nodes to the StateSet of its current colors */
+  void recolor(logical_material* mat, const material_colors& before) const {
+    const ref_ptr<StateSet> old = mat->state;
+    mat->state = state_for(mat->colors);
+    if (mat->state == old)
+      return;
+
+    for (std::vector<ref_ptr<Node>>::const_iterator n = mat->nodes.begin(); n != mat->nodes.end(); n++)
+      (*n)->setStateSet(mat->state.get());
+
+    /* only the table and old are left */
+    const t_material_states::iterator unused = material_states.find(before);
+    if (unused != material_states.end() && unused->second == old && old->referenceCount() == 2)
+      material_states.erase(unused);
   }
 
   void operator()(const CreateMaterial& cmd) const {
-    ref_ptr<Material> mat = new Material();
-    mat->setName(cmd.name);
-    material_cache[cmd.name] = mat;
+    material_cache[cmd.name] = new logical_material();
   }
 
   void operator()(const ApplyMaterial& cmd) const {
@@ -85,10 +246,14 @@ public:
 
     std::cout << "Apply material " << cmd.target << " on " << cmd.name << std::endl;
 
-    const ref_ptr<Material> mat = material_cache[cmd.target];
+    const ref_ptr<logical_material> mat = material_cache[cmd.target];
+    if (!mat->state.valid())
+      mat->state = state_for(mat->colors);
 
-    ref_ptr<StateSet> stateSet = node_cache[cmd.name] -> getChild(0) -> getOrCreateStateSet();
-    stateSet->setAttribute(mat.get());
+    /* on the transform, so that a material of a group reaches all of its members */
+    const ref_ptr<Node> node = node_cache[cmd.name];
+    node->setStateSet(mat->state.get());
+    mat->nodes.push_back(node);
   }
 
   void operator()(const CreateSphere& cmd) const {
@@ -202,89 +367,158 @@ public:
     root->addChild(trans);
   }
 
-  void operator()(const Move& cmd) const {
-    if (node_cache.find(cmd.name) == node_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find " << cmd.name << std::endl;
-      return;
-    }
+  /* parametric shapes keep their geometry, SetShapeParameter updates it in place */
+  void add_parametric(const ParametricShapeOperation& cmd, const ParametricShape::Kind kind) const {
+    const ref_ptr<ParametricShape> shape = new ParametricShape(kind, cmd);
+    const ref_ptr<Geode> geode = new Geode();
+    geode->addDrawable(shape);
 
-    node_cache[cmd.name] -> setPosition(Vec3d(cmd.x, cmd.y, cmd.z));
+    const ref_ptr<PositionAttitudeTransform> trans =
+      new PositionAttitudeTransform();
+    trans->addChild(geode);
+    trans->setName(cmd.name);
+
+    shape_cache[cmd.name] = shape;
+    node_cache[cmd.name] = trans;
+    root->addChild(trans);
   }
 
-  void operator()(const Scale& cmd) const {
-    if (node_cache.find(cmd.name) == node_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find " << cmd.name << std::endl;
-      return;
-    }
+  void operator()(const CreateSpring& cmd) const {
+    add_parametric(cmd, ParametricShape::SPRING);
+  }
 
-    node_cache[cmd.name] -> setScale(Vec3d(cmd.x, cmd.y, cmd.z));
+  void operator()(const CreatePipe& cmd) const {
+    add_parametric(cmd, ParametricShape::PIPE);
   }
 
-  void operator()(const RotateEuler& cmd) const {
-    if (node_cache.find(cmd.name) == node_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find " << cmd.name << std::endl;
-      return;
-    }
+  void operator()(const CreateGearwheel& cmd) const {
+    add_parametric(cmd, ParametricShape::GEARWHEEL);
+  }
 
-    Quat q(cmd.x, osg::Vec3(1,0,0), cmd.y, osg::Vec3(0,1,0), cmd.z, osg::Vec3(0,0,1));
-    node_cache[cmd.name] -> setAttitude(q);
+  /*
+    Undo the timeline ops before a seek replays them (see proc3d::Playback):
+    parametric shapes get their setup parameters, transforms the attitude they
+    were created with. Rotation tracks set theirs again right after.
+   */
+  void restore_setup() const {
+    for (t_shape_table::const_iterator s = shape_table.begin(); s != shape_table.end(); s++)
+      if (s->valid())
+	(*s)->restore();
+
+    for (t_node_table::const_iterator n = node_table.begin(); n != node_table.end(); n++)
+      if (n->valid())
+	(*n)->setAttitude(Quat());
   }
 
-  void operator()(const RotateMatrix& cmd) const {
-    if (node_cache.find(cmd.name) == node_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find " << cmd.name << std::endl;
-      return;
-    }
+  /* track values, see proc3d::TrackCursor */
 
-    Quat q;
-    const auto& m = cmd.m;
+  void set_translation(const object_handle h, const Channel<3>::value_type& v) const {
+    PositionAttitudeTransform* const n = find_node(h);
+    if (!n) return;
 
-    q.set(osg::Matrixd(m(0,0), m(0,1), m(0,2), 0.0,
-                       m(1,0), m(1,1), m(1,2), 0.0,
-                       m(2,0), m(2,1), m(2,2), 0.0,
-                       0.0, 0.0, 0.0, 1.0));
+    n -> setPosition(Vec3d(v[0], v[1], v[2]));
+  }
+
+  void set_scale(const object_handle h, const Channel<3>::value_type& v) const {
+    PositionAttitudeTransform* const n = find_node(h);
+    if (!n) return;
 
-    node_cache[cmd.name] -> setAttitude(q);
+    n -> setScale(Vec3d(v[0], v[1], v[2]));
   }
 
-  void operator()(const SetMaterialProperty& cmd) const {
-    if (material_cache.find(cmd.name) == material_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find material: " << cmd.name << std::endl;
-      return;
-    }
-    //no properties defined yet ...
+  void set_rotation(const object_handle h, const Channel<4>::value_type& q) const {
+    PositionAttitudeTransform* const n = find_node(h);
+    if (!n) return;
+
+    n -> setAttitude(Quat(q[0], q[1], q[2], q[3]));
   }
 
   static inline Vec4d vec4_from_array(const boost::array<double, 4>& arr) {
     return Vec4d(arr[0],arr[1],arr[2],arr[3]);
   }
 
-  void operator()(const SetAmbientColor& cmd) const {
-    if (material_cache.find(cmd.name) == material_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find material: " << cmd.name << std::endl;
-      return;
-    }
+  void set_ambient(const object_handle h, const Channel<4>::value_type& color) const {
+    logical_material* const mat = find_material(h);
+    if (!mat) return;
 
-    std::cout << "Setting ambient color on " << cmd.name << " at t= " << cmd.time << std::endl;
-    material_cache[cmd.name]->setAmbient(Material::FRONT, vec4_from_array(cmd.color));
+    const material_colors before = mat->colors;
+    mat->colors.ambient = vec4_from_array(color);
+    if (mat->state.valid())
+      recolor(mat, before);
   }
 
-  void operator()(const SetDiffuseColor& cmd) const {
-    if (material_cache.find(cmd.name) == material_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find material: " << cmd.name << std::endl;
-      return;
-    }
+  void set_diffuse(const object_handle h, const Channel<4>::value_type& color) const {
+    logical_material* const mat = find_material(h);
+    if (!mat) return;
 
-    material_cache[cmd.name]->setDiffuse(Material::FRONT, vec4_from_array(cmd.color));
+    const material_colors before = mat->colors;
+    mat->colors.diffuse = vec4_from_array(color);
+    if (mat->state.valid())
+      recolor(mat, before);
   }
 
-  void operator()(const SetSpecularColor& cmd) const {
-    if (material_cache.find(cmd.name) == material_cache.end()) {
-      std::cout << "Inconsistent naming. Did not find material: " << cmd.name << std::endl;
+  void set_specular(const object_handle h, const Channel<4>::value_type& color) const {
+    logical_material* const mat = find_material(h);
+    if (!mat) return;
+
+    const material_colors before = mat->colors;
+    mat->colors.specular = vec4_from_array(color);
+    if (mat->state.valid())
+      recolor(mat, before);
+  }
+
+  /* delta ops */
+
+  void operator()(const Move& cmd) const {
+    const Channel<3>::value_type v = {{cmd.x, cmd.y, cmd.z}};
+    set_translation(cmd.handle, v);
+  }
+
+  void operator()(const Scale& cmd) const {
+    const Channel<3>::value_type v = {{cmd.x, cmd.y, cmd.z}};
+    set_scale(cmd.handle, v);
+  }
+
+  void operator()(const RotateEuler& cmd) const {
+    PositionAttitudeTransform* const n = find_node(cmd.handle);
+    if (!n) return;
+
+    Quat q(cmd.x, osg::Vec3(1,0,0), cmd.y, osg::Vec3(0,1,0), cmd.z, osg::Vec3(0,0,1));
+    n -> setAttitude(q);
+  }
+
+  void operator()(const RotateMatrix& cmd) const {
+    const auto& m = cmd.m;
+    const rotation_matrix v = {{m(0,0), m(0,1), m(0,2),
+                                m(1,0), m(1,1), m(1,2),
+                                m(2,0), m(2,1), m(2,2)}};
+    set_rotation(cmd.handle, quat_from_matrix(v));
+  }
+
+  void operator()(const SetMaterialProperty& cmd) const {
+    if (!find_material(cmd.handle)) return;
+    //no properties defined yet ...
+  }
+
+  void operator()(const SetShapeParameter& cmd) const {
+    if (cmd.handle >= shape_table.size() || !shape_table[cmd.handle].valid()) {
+      std::cout << "Inconsistent naming. Did not find parametric shape: " << name_of(cmd.handle) << std::endl;
       return;
     }
+    shape_table[cmd.handle]->set(cmd.parameter, cmd.value);
+  }
 
-    material_cache[cmd.name]->setSpecular(Material::FRONT, vec4_from_array(cmd.color));
+  void operator()(const SetAmbientColor& cmd) const {
+    std::cout << "Setting ambient color on " << name_of(cmd.handle) << " at t= " << cmd.time << std::endl;
+    set_ambient(cmd.handle, cmd.color);
+  }
+
+  void operator()(const SetDiffuseColor& cmd) const {
+    set_diffuse(cmd.handle, cmd.color);
+  }
+
+  void operator()(const SetSpecularColor& cmd) const {
+    set_specular(cmd.handle, cmd.color);
   }
 
   // LoadObject
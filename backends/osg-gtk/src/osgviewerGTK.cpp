@@ -22,6 +22,7 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <osg/Stats>
@@ -31,6 +32,8 @@
 #include "osggtkdrawingarea.h"
 #include "osgviewerGTK.hpp"
 #include "osg_interpreter.hpp"
+#include "playback.hpp"
+#include "recording.hpp"
 
 /* Implementation based on OSG GTK Example code */
 
@@ -48,11 +51,20 @@ class OSG_GTK_Mod3DViewer : public OSGGTKDrawingArea {
 	double timeScaler;          // scale time to slow things down or speed things up
 	timeval startTime;			// to store start of simulation
 	unsigned int _tid;
+	GtkWidget* _slider;			// timeline scrubber
+	bool _updatingSlider;
 
-	const proc3d::animation_queue& stored_animation;
-	proc3d::animation_queue animation;
+	const proc3d::AnimationContext& context;
+	proc3d::Recording* recording;		// NULL unless replaying a file, then context is its window
+	proc3d::WorkerPool pool;		// evaluates the tracks of large scenes in parallel
+	proc3d::Playback playback;
 	std::map<std::string, ref_ptr<PositionAttitudeTransform>> nodes;
-	std::map<std::string, ref_ptr<Material>> materials;
+	t_material_cache materials;
+	t_node_table node_table;
+	t_material_table material_table;
+	t_material_states material_states;
+	t_shape_cache shapes;
+	t_shape_table shape_table;
 	const osg::ref_ptr<osg::Group> scene_content;
 	const proc3d_osg_interpreter interpreter;
 
@@ -163,15 +175,20 @@ protected:
 	}
 
 public:
-	OSG_GTK_Mod3DViewer(const proc3d::animation_queue& q):
+	OSG_GTK_Mod3DViewer(const proc3d::AnimationContext& context, proc3d::Recording* recording):
 		OSGGTKDrawingArea (),
 		_menu             (gtk_menu_new()),
 		_tid              (0),
-		stored_animation  (q),
+		_slider           (NULL),
+		_updatingSlider   (false),
+		context           (context),
+		recording         (recording),
+		playback          (context),
 		scene_content(new osg::Group()),
-		interpreter(scene_content, nodes, materials),
+		interpreter(scene_content, context.registry, nodes, materials, node_table, material_table, material_states, shapes, shape_table),
 		timeScaler(1.0) {
 		scene_content->setName("root");
+		playback.parallel(&pool);
 
 		gtk_widget_show_all(_menu);
 		setSceneData(scene_content);
@@ -190,6 +207,7 @@ public:
 			boost::apply_visitor( interpreter, op );
 			setup.pop();
 		}
+		interpreter.resolve_handles();
 
 		// add menu item for each object
 		for(std::map<std::string, ref_ptr<PositionAttitudeTransform>>::iterator i = nodes.begin(); i!= nodes.end(); i++) {
@@ -200,22 +218,40 @@ public:
 		}
 		gtk_widget_show_all(_menu);
 
+		playback.build_checkpoints(1.0);
+
 		/* activate first frame */
 		currentTime = 0.0;
-		if (animation.empty())
-			tOffset = 0.0;
-		else
-			tOffset = proc3d::time_of(animation.top());		// only useful, if startTime != 0.0
+		tOffset = start_time();		// only useful, if startTime != 0.0
 		advance_animation();
 	}
 
+	double start_time() const {
+		return recording ? recording->start_time() : context.start_time();
+	}
+
+	double end_time() const {
+		return recording ? recording->end_time() : context.end_time();
+	}
+
+	/* make sure the recording window covering t is loaded, returns true if it changed */
+	bool load_window(const double t) {
+		if (!recording || !recording->load(t))
+			return false;
+		playback.build_checkpoints(1.0);
+		return true;
+	}
+
+	/* a window without keys after t is not the end of a recording, the next window is loaded once t reaches it */
+	bool more_windows(const double t) const {
+		return recording && t <= end_time();
+	}
+
 	void restart_animation() {
-		animation = proc3d::animation_queue(stored_animation);
+		load_window(start_time());
+		playback.restart();
 		currentTime = 0.0;
-		if (animation.empty())
-			tOffset = 0.0;
-		else
-			tOffset = proc3d::time_of(animation.top());		// only useful, if startTime != 0.0
+		tOffset = start_time();		// only useful, if startTime != 0.0
 		gettimeofday(&startTime, NULL);
 	}
 
@@ -231,21 +267,43 @@ public:
 
 		// std::cout << "Update at t=" << currentTime << std::endl;
 
-		if (animation.empty()) {
+		if (currentTime <= end_time() && load_window(currentTime))
+			playback.seek(currentTime, interpreter);
+		else if (!playback.advance(currentTime, interpreter) && !more_windows(currentTime))
 			restart_animation();
-		} else {
-			AnimOperation op = animation.top();
-			// std::cout << "Anim command for t= " << proc3d::time_of(op) << std::endl;
-			while (proc3d::time_of(op) <= currentTime && !animation.empty()) {
-				boost::apply_visitor( interpreter, op );
-				animation.pop();
-				op = animation.top();
-			}
-		}
 
+		update_slider();
+		queueDraw();
+	}
+
+	/* restore the scene at t, playing (or pausing) continues from there */
+	void seek(const double t) {
+		load_window(t);
+		playback.seek(t, interpreter);
+		currentTime = t;
+		tOffset = t;
+		gettimeofday(&startTime, NULL);
 		queueDraw();
 	}
 
+	GtkWidget* createSlider() {
+		const double start = start_time();
+		const double end = std::max(end_time(), start + 0.01);
+
+		_slider = gtk_hscale_new_with_range(start, end, (end - start) / 1000.0);
+		gtk_scale_set_draw_value(GTK_SCALE(_slider), true);
+		gtk_scale_set_digits(GTK_SCALE(_slider), 2);
+		g_signal_connect(G_OBJECT(_slider), "value-changed", G_CALLBACK(OSG_GTK_Mod3DViewer::scrub), this);
+		return _slider;
+	}
+
+	void update_slider() {
+		if (!_slider) return;
+		_updatingSlider = true;
+		gtk_range_set_value(GTK_RANGE(_slider), currentTime);
+		_updatingSlider = false;
+	}
+
 	// Public so that we can use this as a callback in main().
 	static bool clicked(GtkWidget* widget, gpointer self) {
 		return static_cast<OSG_GTK_Mod3DViewer*>(self)->_clicked(widget);
@@ -256,6 +314,13 @@ public:
 		return static_cast<OSG_GTK_Mod3DViewer*>(self)->_setFocus(widget);
 	}
 
+	// Public so that we can use this as a callback in main().
+	static void scrub(GtkRange* range, gpointer self) {
+		OSG_GTK_Mod3DViewer* viewer = static_cast<OSG_GTK_Mod3DViewer*>(self);
+		if (!viewer->_updatingSlider)
+			viewer->seek(gtk_range_get_value(range));
+	}
+
 	static bool timeout(void* self) {
 		/* issue re-drawing */
 		static_cast<OSG_GTK_Mod3DViewer*>(self) -> advance_animation();
@@ -263,16 +328,12 @@ public:
 	}
 };
 
-int run_viewer(const proc3d::AnimationContext& context) {
-
-	std::cout << "Starting GTK based viewer " << std::endl;
-	std::cout << "Setup queue: " << context.setupOps.size() << " entries." << std::endl;
-	std::cout << "Animation queue: " << context.deltaOps.size() << " entries." << std::endl;
+static int run(const proc3d::AnimationContext& context, proc3d::Recording* recording) {
 
 	gtk_init(0, NULL);
 	gtk_gl_init(0, NULL);
 
-	OSG_GTK_Mod3DViewer da(context.deltaOps);
+	OSG_GTK_Mod3DViewer da(context, recording);
 	da.setup_scene(context.setupOps);
 
 	if(da.createWidget(640, 480)) {
@@ -314,6 +375,7 @@ int run_viewer(const proc3d::AnimationContext& context) {
 		gtk_box_pack_start(GTK_BOX(hbox), label, true, true, 2);
 
 		gtk_box_pack_start(GTK_BOX(vbox1), da.getWidget(), true, true, 2);
+		gtk_box_pack_start(GTK_BOX(vbox1), da.createSlider(), false, false, 2);
 		gtk_box_pack_start(GTK_BOX(vbox1), hbox, false, false, 2);
 
 		gtk_container_set_reallocate_redraws(GTK_CONTAINER(window), true);
@@ -335,6 +397,33 @@ int run_viewer(const proc3d::AnimationContext& context) {
 	return 0;
 }
 
+int run_viewer(const proc3d::AnimationContext& context) {
+
+	std::cout << "Starting GTK based viewer " << std::endl;
+	std::cout << "Setup queue: " << context.setupOps.size() << " entries." << std::endl;
+	std::cout << "Animation tracks: " << context.tracks.keyframes() << " keyframes." << std::endl;
+	std::cout << "Animation queue: " << context.deltaOps.size() << " entries." << std::endl;
+	std::cout << "Received " << context.stats.pushed() << " delta ops, "
+		  << context.memory() / 1024 << " KB in use, peak "
+		  << std::max(context.stats.peak_bytes(), context.memory()) / 1024 << " KB." << std::endl;
+
+	return run(context, NULL);
+}
+
+int run_recording(const char* file) {
+
+	proc3d::Recording recording;
+	if (!recording.open(file))
+		return 1;
+
+	std::cout << "Starting GTK based viewer on " << file << std::endl;
+	std::cout << "Setup queue: " << recording.context().setupOps.size() << " entries." << std::endl;
+	std::cout << "Recorded time: " << recording.start_time() << " - " << recording.end_time() << " s" << std::endl;
+
+	recording.load(recording.start_time());
+	return run(recording.context(), &recording);
+}
+
 extern "C" {
 
 void* osg_gtk_alloc_context() {
@@ -23,17 +23,32 @@
 
 #include "animationContext.hpp"
 #include "operations.hpp"
+#include "recording.hpp"
 
 /* signal definitions */
 #define RUN_ANIMATION 1
 
 extern int run_viewer(const proc3d::AnimationContext& context);
 
+/* replay a file written by proc3d_save_recording */
+extern int run_recording(const char* file);
+
 class GTKAnimationContext : public proc3d::AnimationContext {
   
   virtual void handleSignal(const int signal) {
     switch (signal) {
-    case RUN_ANIMATION: run_viewer(*this);
+    case RUN_ANIMATION:
+      /* the ring reader must not push while the tracks are merged and played */
+      finish_ring();
+
+      /* a streamed animation is only complete on disk */
+      if (spill) {
+	if (finish_spill())
+	  run_recording(spill->file().c_str());
+      } else {
+	commit();
+	run_viewer(*this);
+      }
     }
   }
 };
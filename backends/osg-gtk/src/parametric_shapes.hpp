@@ -0,0 +1,281 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <osg/Geometry>
+#include <osg/Math>
+#include <osg/PrimitiveSet>
+#include <osg/Quat>
+
+#include "operations.hpp"
+
+/*
+  Geometry generated from the parameters of a Modelica shape (see
+  proc3d::ShapeParameter). Changing a parameter regenerates the vertices
+  into the same arrays and only marks them dirty, so a spring that changes
+  its length every frame costs no allocations and no new scene graph
+  nodes. The indices are only rebuilt when the number of vertices changes
+  (windings or teeth).
+
+  The shapes are built along z and turned to point along at, like the
+  other shapes.
+ */
+class ParametricShape : public osg::Geometry {
+public:
+  enum Kind { SPRING, PIPE, GEARWHEEL };
+
+  /* tessellation */
+  static const int SPRING_SEGMENTS = 24;	// per winding
+  static const int SPRING_SIDES = 8;		// around the wire
+  static const int PIPE_SIDES = 32;
+
+  ParametricShape(const Kind k, const proc3d::ParametricShapeOperation& op) :
+    kind(k), parameters(op.parameters), setup(op.parameters),
+    vertices(new osg::Vec3Array()), normals(new osg::Vec3Array()),
+    indices(new osg::DrawElementsUInt(osg::PrimitiveSet::TRIANGLES)) {
+
+    osg::Vec3 target(op.at[0], op.at[1], op.at[2]);
+    if (target.length2() == 0.0)
+      target = osg::Vec3(0, 0, 1);
+    attitude.makeRotate(osg::Vec3(0, 0, 1), target);
+
+    /* the arrays change, so keep them in buffer objects instead of display lists */
+    setUseDisplayList(false);
+    setUseVertexBufferObjects(true);
+    setDataVariance(osg::Object::DYNAMIC);
+
+    setVertexArray(vertices.get());
+    setNormalArray(normals.get());
+    setNormalBinding(osg::Geometry::BIND_PER_VERTEX);
+    addPrimitiveSet(indices.get());
+    update();
+  }
+
+  /* set one parameter and regenerate the geometry, returns false for unknown parameters */
+  bool set(const unsigned int parameter, const double value) {
+    if (parameter >= proc3d::SHAPE_PARAMETERS)
+      return false;
+    if (parameters[parameter] == value)
+      return true;
+
+    parameters[parameter] = value;
+    update();
+    return true;
+  }
+
+  /* back to the parameters it was created with */
+  void restore() {
+    if (parameters == setup)
+      return;
+
+    parameters = setup;
+    update();
+  }
+
+private:
+  const Kind kind;
+  boost::array<double, proc3d::SHAPE_PARAMETERS> parameters;
+  const boost::array<double, proc3d::SHAPE_PARAMETERS> setup;
+  osg::Quat attitude;
+
+  const osg::ref_ptr<osg::Vec3Array> vertices;
+  const osg::ref_ptr<osg::Vec3Array> normals;
+  const osg::ref_ptr<osg::DrawElementsUInt> indices;
+
+  double length() const { return parameters[proc3d::SHAPE_LENGTH]; }
+  double radius() const { return parameters[proc3d::SHAPE_WIDTH] / 2.0; }
+
+  void update() {
+    const std::size_t before = vertices->size();
+    vertices->clear();
+    normals->clear();
+
+    switch (kind) {
+    case SPRING: spring(); break;
+    case PIPE: pipe(); break;
+    case GEARWHEEL: gearwheel(); break;
+    }
+
+    if (vertices->size() != before || indices->empty()) {
+      indices->clear();
+      switch (kind) {
+      case SPRING: spring_indices(); break;
+      case PIPE: pipe_indices(); break;
+      case GEARWHEEL: gearwheel_indices(); break;
+      }
+      indices->dirty();
+    }
+
+    vertices->dirty();
+    normals->dirty();
+    dirtyBound();
+  }
+
+  void add(const osg::Vec3& v, const osg::Vec3& n) {
+    vertices->push_back(attitude * v);
+    normals->push_back(attitude * n);
+  }
+
+  void quad(const unsigned int a, const unsigned int b, const unsigned int c, const unsigned int d) {
+    indices->push_back(a); indices->push_back(b); indices->push_back(c);
+    indices->push_back(a); indices->push_back(c); indices->push_back(d);
+  }
+
+  /* quads between consecutive rings of the given size, flipped ones face the other way */
+  void rings(const unsigned int first, const unsigned int count, const unsigned int sides, const bool flipped = false) {
+    for (unsigned int r = 0; r + 1 < count; r++)
+      for (unsigned int s = 0; s < sides; s++) {
+	const unsigned int a = first + r * sides, b = first + (r + 1) * sides;
+	const unsigned int t = (s + 1) % sides;
+	if (flipped)
+	  quad(a + s, b + s, b + t, a + t);
+	else
+	  quad(a + s, a + t, b + t, b + s);
+      }
+  }
+
+  /* spring: a wire of diameter height wound extra times around the axis */
+  unsigned int spring_points() const {
+    const double windings = std::max(parameters[proc3d::SHAPE_EXTRA], 0.0);
+    return std::max(2, int(std::ceil(windings * SPRING_SEGMENTS)) + 1);
+  }
+
+  void spring() {
+    const double windings = std::max(parameters[proc3d::SHAPE_EXTRA], 0.0);
+    const double coil = radius(), wire = parameters[proc3d::SHAPE_HEIGHT] / 2.0;
+    const unsigned int points = spring_points();
+    const double sweep = 2.0 * osg::PI * windings;
+
+    for (unsigned int i = 0; i < points; i++) {
+      const double s = double(i) / (points - 1), phi = s * sweep;
+      const double c = std::cos(phi), d = std::sin(phi);
+
+      /* frame along the helix: tangent, towards the axis and their cross product */
+      osg::Vec3 tangent(-coil * d * sweep, coil * c * sweep, length());
+      tangent.normalize();
+      const osg::Vec3 inward(-c, -d, 0);
+      const osg::Vec3 binormal = tangent ^ inward;
+      const osg::Vec3 center(coil * c, coil * d, s * length());
+
+      for (int k = 0; k < SPRING_SIDES; k++) {
+	const double psi = 2.0 * osg::PI * k / SPRING_SIDES;
+	const osg::Vec3 n = inward * std::cos(psi) + binormal * std::sin(psi);
+	add(center + n * wire, n);
+      }
+    }
+  }
+
+  void spring_indices() {
+    rings(0, spring_points(), SPRING_SIDES);
+  }
+
+  /* pipe: outer diameter width, inner diameter extra * width */
+  void pipe() {
+    const double outer = radius();
+    const double inner = outer * std::min(std::max(parameters[proc3d::SHAPE_EXTRA], 0.0), 1.0);
+    const osg::Vec3 up(0, 0, 1);
+
+    /* outer wall, inner wall, bottom and top ring, every one bottom then top */
+    for (int wall = 0; wall < 4; wall++) {
+      for (int end = 0; end < 2; end++) {
+	const double z = (wall == 2 || (wall < 2 && end == 0)) ? 0.0 : length();
+	for (int k = 0; k < PIPE_SIDES; k++) {
+	  const double phi = 2.0 * osg::PI * k / PIPE_SIDES;
+	  const osg::Vec3 radial(std::cos(phi), std::sin(phi), 0);
+	  switch (wall) {
+	  case 0: add(radial * outer + up * z, radial); break;
+	  case 1: add(radial * inner + up * z, -radial); break;
+	  case 2: add(radial * (end ? inner : outer), -up); break;
+	  default: add(radial * (end ? inner : outer) + up * z, up); break;
+	  }
+	}
+      }
+    }
+  }
+
+  void pipe_indices() {
+    for (unsigned int wall = 0; wall < 4; wall++)
+      rings(wall * 2 * PIPE_SIDES, 2, PIPE_SIDES, wall == 1 || wall == 2);
+  }
+
+  /* gearwheel: extra teeth on a wheel of outer diameter width and thickness length */
+  unsigned int teeth() const {
+    return std::max(3, int(std::fabs(parameters[proc3d::SHAPE_EXTRA]) + 0.5));
+  }
+
+  void gearwheel() {
+    const unsigned int n = teeth();
+    const double tip = radius();
+    const double module = 2.0 * tip / (n + 2);
+    const double root = std::max(tip - 2.25 * module, 0.1 * tip);
+
+    /* four corners per tooth: root, tip, tip, root */
+    const unsigned int corners = 4 * n;
+    std::vector<osg::Vec3>& outline = profile;	// reused
+    outline.resize(corners);
+    for (unsigned int i = 0; i < n; i++) {
+      const double pitch = 2.0 * osg::PI / n, a = i * pitch;
+      const double angles[4] = {a, a + 0.2 * pitch, a + 0.45 * pitch, a + 0.65 * pitch};
+      const double radii[4] = {root, tip, tip, root};
+      for (int k = 0; k < 4; k++)
+	outline[4 * i + k] = osg::Vec3(radii[k] * std::cos(angles[k]), radii[k] * std::sin(angles[k]), 0);
+    }
+
+    const osg::Vec3 up(0, 0, 1), top = up * length();
+
+    /* side faces, flat shaded: 4 vertices per edge of the outline */
+    for (unsigned int i = 0; i < corners; i++) {
+      const osg::Vec3& a = outline[i];
+      const osg::Vec3& b = outline[(i + 1) % corners];
+      osg::Vec3 n = (b - a) ^ up;
+      n.normalize();
+      add(a, n); add(b, n); add(b + top, n); add(a + top, n);
+    }
+
+    /* the outline is star shaped around the axis, so both faces are fans */
+    add(osg::Vec3(), -up);
+    for (unsigned int i = 0; i < corners; i++)
+      add(outline[i], -up);
+    add(top, up);
+    for (unsigned int i = 0; i < corners; i++)
+      add(outline[i] + top, up);
+  }
+
+  void gearwheel_indices() {
+    const unsigned int corners = 4 * teeth();
+    for (unsigned int i = 0; i < corners; i++)
+      quad(4 * i, 4 * i + 1, 4 * i + 2, 4 * i + 3);
+
+    const unsigned int bottom = 4 * corners, top = bottom + corners + 1;
+    for (unsigned int i = 0; i < corners; i++) {
+      const unsigned int j = (i + 1) % corners;
+      indices->push_back(bottom); indices->push_back(bottom + 1 + j); indices->push_back(bottom + 1 + i);
+      indices->push_back(top); indices->push_back(top + 1 + i); indices->push_back(top + 1 + j);
+    }
+  }
+
+  std::vector<osg::Vec3> profile;	// outline of the gearwheel
+};
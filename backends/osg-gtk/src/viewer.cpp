@@ -22,5 +22,8 @@
 #include "osgviewerGTK.hpp"
 
 int main(int argc, char** argv) {
+  if (argc > 1)
+    return run_recording(argv[1]);
+
   return run_viewer(proc3d::AnimationContext());
 }
@@ -20,30 +20,234 @@
  */
 
 #define DBUS_STATIC_BUILD   /* In order to link against dbus static lib. */
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <dbus/dbus.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #include "modbus.h"
+#include "modbus_wire.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-DBusError err;
+/* every connection has a lock, the state shared by messages is per thread */
+#ifdef _WIN32
+typedef CRITICAL_SECTION modbus_mutex;
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define THREAD_LOCAL __declspec(thread)
+#define KEY_DESTRUCTOR WINAPI
+#define atomic_increment(p) InterlockedIncrement(p)
+#else
+typedef pthread_mutex_t modbus_mutex;
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define THREAD_LOCAL __thread
+#define KEY_DESTRUCTOR
+#define atomic_increment(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#endif
+
+/*
+  A bus connection and its asynchronous calls in flight, oldest first.
+  Their replies are only looked at for errors, when the window is full,
+  on the next synchronous call or on flush.
+ */
+typedef struct modbus_connection {
+  DBusConnection* conn;
+  int private_bus;			/* closed on release, not shared with other connections */
+  modbus_mutex lock;			/* held by every call that uses the connection */
+  DBusPendingCall* inflight[MODBUS_WINDOW];	/* ring buffer */
+  int first, count;
+  int errors;				/* failed asynchronous calls so far */
+  struct modbus_frame* frame;		/* sent before any other call */
+  struct modbus_ring_writer* ring;	/* drained before any synchronous call */
+} ModbusConnection;
 
 typedef struct modbus_message {
   DBusMessage* msg;
   DBusMessageIter args;
-  DBusMessageIter dict;
+  DBusMessageIter dict;			/* the struct of a typed message */
+  int typed;				/* arguments appended in order, no dict */
 } ModbusMessage;
 
-void* modbus_acquire_session_bus(const char * client_name) {
+/*
+  Method calls without arguments, by target, object, interface and
+  method. Messages are copied from them instead of being built and
+  validated every time.
+ */
+typedef struct modbus_template {
+  uint32_t hash;
+  char* names[4];
+  DBusMessage* msg;
+} ModbusTemplate;
+
+typedef struct modbus_thread {
+  ModbusTemplate templates[MODBUS_TEMPLATES];
+
+  /*
+    released wrappers, reused by the next allocations. Only the wrapper
+    is pooled: each message still allocates its DBusMessage, copied from
+    the template, since libdbus locks a message once it has been sent.
+   */
+  ModbusMessage* pool[MODBUS_POOL];
+  int pooled;
+} ModbusThread;
+
+/* allocated by the first message of a thread, so that the threads need no lock */
+static THREAD_LOCAL ModbusThread* thread_state = NULL;
+
+/* released when its thread ends, registered with a thread key */
+static void KEY_DESTRUCTOR thread_free(void* vthread) {
+  ModbusThread* thread = (ModbusThread*)vthread;
+  if (NULL == thread)
+    return;
+
+  for (int i = 0; i < MODBUS_TEMPLATES; i++) {
+    ModbusTemplate* tpl = &(thread->templates[i]);
+    if (NULL == tpl->msg)
+      continue;
+    for (int k = 0; k < 4; k++)
+      free(tpl->names[k]);
+    dbus_message_unref(tpl->msg);
+  }
+  for (int i = 0; i < thread->pooled; i++)
+    free(thread->pool[i]);
+  free(thread);
+  thread_state = NULL;
+}
+
+#ifdef _WIN32
+static DWORD thread_key;
+static INIT_ONCE thread_key_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK thread_key_create(PINIT_ONCE once, PVOID parameter, PVOID* context) {
+  thread_key = FlsAlloc(thread_free);
+  return TRUE;
+}
+
+#define thread_key_init() InitOnceExecuteOnce(&thread_key_once, thread_key_create, NULL, NULL)
+#define thread_key_set(v) FlsSetValue(thread_key, v)
+#else
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_key_create(void) {
+  pthread_key_create(&thread_key, thread_free);
+}
+
+#define thread_key_init() pthread_once(&thread_key_once, thread_key_create)
+#define thread_key_set(v) pthread_setspecific(thread_key, v)
+#endif
+
+static ModbusThread* this_thread(void) {
+  if (NULL == thread_state) {
+    thread_state = (ModbusThread*)calloc(1, sizeof(ModbusThread));
+    thread_key_init();
+    thread_key_set(thread_state);
+  }
+  return thread_state;
+}
+
+/* frames and rings outlive a released connection, they lock nothing then */
+static void lock(ModbusConnection* connection) {
+  if (connection)
+    mutex_lock(&(connection->lock));
+}
+
+static void unlock(ModbusConnection* connection) {
+  if (connection)
+    mutex_unlock(&(connection->lock));
+}
+
+/* references and the numbers they were given in order, open addressing */
+typedef struct modbus_names {
+  char** names;
+  uint32_t* numbers;
+  uint32_t slots, used;
+} ModbusNames;
+
+/*
+  The updates of one time step, collected into a single call whose
+  arguments are {"t": d, "records": a(ssad)}, every record being the
+  reference, the op and its values. The call is only built while
+  records come in, the open containers are kept here.
+
+  With a quantum, translations and rotation matrices go to the byte array
+  "packed" instead, next to the "quantum" of its positions and the
+  "stream" of the frame.
+ */
+typedef struct modbus_frame {
+  ModbusConnection* connection;
+  char* target;
+  char* object;
+  char* interface;
+  char* method;
+
+  ModbusMessage message;		/* NULL msg while there are no records */
+  DBusMessageIter entry, variant, records;
+  double t;
+  int count;
+
+  double quantum;			/* 0 sends every record in full */
+  long stream;				/* tells the packed transforms of the frames of a sender apart */
+  ModbusNames references;
+  ModbusPacked* sent;			/* by reference number */
+  uint8_t* packed;
+  size_t packed_size, packed_capacity;
+  int resync;				/* a call failed, the next frame starts with key records */
+} ModbusFrame;
+
+/*
+  Writer of a shared memory ring (see modbus_wire.h). Without a ring,
+  because the server is remote or does not support it, the records go to
+  the frame of the connection instead, or without a frame as typed calls.
+ */
+typedef struct modbus_ring_writer {
+  ModbusConnection* connection;
+  char* target;
+  char* object;
+  char* interface;
+  ModbusRing* ring;
+  size_t bytes;
+  uint64_t head;			/* private copy of ring->head */
+
+  ModbusNames references;		/* sent so far */
+  unsigned long lost;			/* records that could not be sent at all */
+} ModbusRingWriter;
+
+/* streams of the frames of this process, connections may share their bus name */
+static volatile long frame_streams = 0;
+
+static void frame_post(ModbusFrame* frame);
+static void ring_drain(ModbusRingWriter* writer);
+static void frame_add(ModbusFrame* frame, const char* reference, const char* op, double t, const double* values, int n);
+
+void* modbus_acquire_bus(const char * client_name, int private_bus) {
+  DBusError err;
   dbus_error_init(&err);
 
+  /* implicit since libdbus 1.7, older ones need it for connections used by several threads */
+  dbus_threads_init_default();
+
   /* taken from http://www.matthew.ath.cx/misc/dbus */
-  DBusConnection* conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+  DBusConnection* conn = private_bus ? dbus_bus_get_private(DBUS_BUS_SESSION, &err) : dbus_bus_get(DBUS_BUS_SESSION, &err);
    
    if (dbus_error_is_set(&err)) { 
       fprintf(stderr, "Connection Error (%s)\n", err.message); 
@@ -54,9 +258,9 @@ void* modbus_acquire_session_bus(const char * client_name) {
       exit(1); 
    }
 
-   // request a name on the bus
+   // request a name on the bus, a private connection does without if another one has it
    int ret = dbus_bus_request_name(conn, client_name, 
-         DBUS_NAME_FLAG_REPLACE_EXISTING 
+         private_bus ? DBUS_NAME_FLAG_DO_NOT_QUEUE : DBUS_NAME_FLAG_REPLACE_EXISTING
          , &err);
 
    if (dbus_error_is_set(&err)) { 
@@ -64,54 +268,254 @@ void* modbus_acquire_session_bus(const char * client_name) {
       dbus_error_free(&err); 
    }
 
-   if (DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != ret) { 
+   // the shared connection already has the name if it was acquired before
+   if (!private_bus && DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != ret && DBUS_REQUEST_NAME_REPLY_ALREADY_OWNER != ret) { 
       exit(1);
    }
-   
-   return (void*)conn;
+
+   ModbusConnection* connection = (ModbusConnection*)malloc(sizeof(ModbusConnection));
+   connection->conn = conn;
+   connection->private_bus = private_bus;
+   mutex_init(&(connection->lock));
+   connection->first = connection->count = 0;
+   connection->errors = 0;
+   connection->frame = NULL;
+   connection->ring = NULL;
+   return connection;
+}
+
+void* modbus_acquire_session_bus(const char * client_name) {
+  return modbus_acquire_bus(client_name, 0);
+}
+
+/* the failed call may have carried packed transforms, the frame starts over with keys */
+static void call_failed(ModbusConnection* connection) {
+  connection->errors++;
+  if (connection->frame)
+    connection->frame->resync = 1;
+}
+
+/* look at the reply of the oldest call in flight, blocks until it is there */
+static void reap_oldest(ModbusConnection* connection) {
+  DBusPendingCall* pending = connection->inflight[connection->first];
+  connection->first = (connection->first + 1) % MODBUS_WINDOW;
+  connection->count--;
+
+  dbus_pending_call_block(pending);
+  DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+  dbus_pending_call_unref(pending);
+
+  if (NULL == reply) {
+    call_failed(connection);
+    fprintf(stderr, "Asynchronous call got no reply\n");
+    return;
+  }
+
+  if (DBUS_MESSAGE_TYPE_ERROR == dbus_message_get_type(reply)) {
+    DBusError err;
+    dbus_error_init(&err);
+    call_failed(connection);
+    dbus_set_error_from_message(&err, reply);
+    fprintf(stderr, "Asynchronous call failed (%s)\n", err.message);
+    dbus_error_free(&err);
+  }
+  dbus_message_unref(reply);
+}
+
+/* reap the calls that completed already, without blocking */
+static void reap_completed(ModbusConnection* connection) {
+  dbus_connection_read_write(connection->conn, 0);
+  while (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_dispatch(connection->conn))
+    ;
+
+  while (connection->count > 0 && dbus_pending_call_get_completed(connection->inflight[connection->first]))
+    reap_oldest(connection);
+}
+
+static int flush_locked(ModbusConnection* connection) {
+  if (connection->frame)
+    frame_post(connection->frame);
+  if (connection->ring)
+    ring_drain(connection->ring);
+  dbus_connection_flush(connection->conn);
+  while (connection->count > 0)
+    reap_oldest(connection);
+  return connection->errors;
+}
+
+int modbus_connection_flush(void* vconn) {
+  ModbusConnection* connection = (ModbusConnection*)vconn;
+  lock(connection);
+  const int errors = flush_locked(connection);
+  unlock(connection);
+  return errors;
 }
 
 void modbus_release_bus(void* vconn) {
-  DBusConnection* conn = (DBusConnection*)vconn;
-  dbus_connection_unref(conn);
+  ModbusConnection* connection = (ModbusConnection*)vconn;
+  lock(connection);
+  if (flush_locked(connection) > 0)
+    fprintf(stderr, "%d asynchronous calls failed\n", connection->errors);
+  if (connection->frame)
+    connection->frame->connection = NULL;
+  if (connection->ring)
+    connection->ring->connection = NULL;
+  unlock(connection);
+
+  if (connection->private_bus)
+    dbus_connection_close(connection->conn);
+  dbus_connection_unref(connection->conn);
+  mutex_destroy(&(connection->lock));
+  free(connection);
 }
 
-void* modbus_msg_alloc(const char *target, const char* object, const char *interface, const char* method) {
-  ModbusMessage* message = (ModbusMessage*)malloc(sizeof(ModbusMessage));
+static uint32_t hash_string(uint32_t h, const char* s) {
+  for (; s && *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return (h ^ 0xff) * 16777619u;	/* separates consecutive strings */
+}
+
+static int same_string(const char* a, const char* b) {
+  return a == b || (a && b && 0 == strcmp(a, b));
+}
+
+/* a new method call, copied from its template, the caller owns the copy */
+static DBusMessage* method_call(const char *target, const char* object, const char *interface, const char* method) {
+  const char* names[4] = {target, object, interface, method};
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 4; i++)
+    hash = hash_string(hash, names[i]);
+
+  ModbusTemplate* templates = this_thread()->templates;
+  for (uint32_t n = 0, i = hash; n < MODBUS_TEMPLATES; n++, i++) {
+    ModbusTemplate* tpl = &templates[i & (MODBUS_TEMPLATES - 1)];
+    if (NULL == tpl->msg) {
+      tpl->msg = dbus_message_new_method_call(target, object, interface, method);
+      if (NULL == tpl->msg)
+	return NULL;
+      tpl->hash = hash;
+      for (int k = 0; k < 4; k++)
+	tpl->names[k] = names[k] ? strdup(names[k]) : NULL;
+      return dbus_message_copy(tpl->msg);
+    }
+
+    if (tpl->hash == hash && same_string(tpl->names[0], target) && same_string(tpl->names[1], object) &&
+	same_string(tpl->names[2], interface) && same_string(tpl->names[3], method))
+      return dbus_message_copy(tpl->msg);
+  }
+
+  /* all templates taken */
+  return dbus_message_new_method_call(target, object, interface, method);
+}
 
-  message->msg = dbus_message_new_method_call(target, object, interface, method);
+static void msg_init(ModbusMessage* message, const char *target, const char* object, const char *interface, const char* method, int typed) {
+  message->msg = method_call(target, object, interface, method);
   if (NULL == message->msg) { 
     fprintf(stderr, "Message Null\n");
     exit(1);
   }
 
+  message->typed = typed;
   dbus_message_iter_init_append(message->msg, &(message->args));
+  if (typed) {
+    /* libdbus rewrites the signature in the header after every argument at the top level, once for a struct */
+    dbus_message_iter_open_container(&(message->args), DBUS_TYPE_STRUCT, NULL, &(message->dict));
+    return;
+  }
+
   dbus_message_iter_open_container(&(message->args), DBUS_TYPE_ARRAY,
 				   DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
 				   DBUS_TYPE_STRING_AS_STRING
 				   DBUS_TYPE_VARIANT_AS_STRING
 				   DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
 				   &(message->dict));
+}
+
+static ModbusMessage* msg_new(void) {
+  ModbusThread* thread = this_thread();
+  return thread->pooled > 0 ? thread->pool[--thread->pooled] : (ModbusMessage*)malloc(sizeof(ModbusMessage));
+}
+
+void* modbus_msg_alloc(const char *target, const char* object, const char *interface, const char* method) {
+  ModbusMessage* message = msg_new();
+  msg_init(message, target, object, interface, method, 0);
+  return message;
+}
 
+void* modbus_msg_alloc_typed(const char *target, const char* object, const char *interface, const char* method) {
+  ModbusMessage* message = msg_new();
+  msg_init(message, target, object, interface, method, 1);
   return message;
 }
 
+/* complete the arguments before sending */
+static void msg_close(ModbusMessage* message) {
+  dbus_message_iter_close_container(&(message->args), &(message->dict));
+}
+
 void modbus_msg_release(void* vmessage) {
   ModbusMessage* message = (ModbusMessage*)vmessage;
-  // free message
+  // free message, keep its wrapper
   dbus_message_unref(message->msg);  
-  free(message);
+  ModbusThread* thread = this_thread();
+  if (thread->pooled < MODBUS_POOL)
+    thread->pool[thread->pooled++] = message;
+  else
+    free(message);
+}
+
+/* send a call without waiting for its reply */
+static void post(ModbusConnection* connection, DBusMessage* msg) {
+  DBusPendingCall* pending;
+
+  if (MODBUS_WINDOW == connection->count)
+    reap_oldest(connection);
+
+  // send message, the reply is only checked for errors later on
+  if (!dbus_connection_send_with_reply(connection->conn, msg, &pending, -1)) {
+    fprintf(stderr, "Out Of Memory!\n");
+    exit(1);
+  }
+  if (NULL == pending) {
+    fprintf(stderr, "Pending Call Null\n");
+    exit(1);
+  }
+
+  connection->inflight[(connection->first + connection->count) % MODBUS_WINDOW] = pending;
+  connection->count++;
+
+  reap_completed(connection);
+}
+
+void modbus_connection_post_msg(void* vconn, void* vmessage) {
+  ModbusConnection* connection = (ModbusConnection*)vconn;
+  ModbusMessage* message = (ModbusMessage*)vmessage;
+
+  msg_close(message);
+
+  lock(connection);
+  // the records collected so far precede this call
+  if (connection->frame)
+    frame_post(connection->frame);
+
+  post(connection, message->msg);
+  unlock(connection);
 }
 
 const char* modbus_connection_send_msg(void* vconn, void* vmessage) {
-  DBusConnection* conn = (DBusConnection*)vconn;
+  ModbusConnection* connection = (ModbusConnection*)vconn;
+  DBusConnection* conn = connection->conn;
   ModbusMessage* message = (ModbusMessage*)vmessage;
   DBusMessage* reply;
   DBusMessageIter rargs;
   DBusPendingCall* pending;
-  char* stat;
+  const char* stat = "";
   
-  dbus_message_iter_close_container(&(message->args), &(message->dict));
+  msg_close(message);
+
+  // the calls before this one come first, report their errors in order
+  lock(connection);
+  flush_locked(connection);
   
   // send message and get a handle for a reply
   if (!dbus_connection_send_with_reply (conn, message->msg, &pending, -1)) { // -1 is default timeout
@@ -136,6 +540,7 @@ const char* modbus_connection_send_msg(void* vconn, void* vmessage) {
   
   // free the pending message handle
   dbus_pending_call_unref(pending);
+  unlock(connection);
   
   // read the parameters
   if (!dbus_message_iter_init(reply, &rargs))
@@ -185,6 +590,445 @@ void modbus_msg_add_string(void* message, const char* name, const char* value) {
   return msg_add_entry(message, name, &value, DBUS_TYPE_STRING, DBUS_TYPE_STRING_AS_STRING);
 }
 
+void modbus_msg_append_double(void* vmessage, double value) {
+  ModbusMessage* message = (ModbusMessage*)vmessage;
+  dbus_message_iter_append_basic(&(message->dict), DBUS_TYPE_DOUBLE, &value);
+}
+
+void modbus_msg_append_string(void* vmessage, const char* value) {
+  ModbusMessage* message = (ModbusMessage*)vmessage;
+  dbus_message_iter_append_basic(&(message->dict), DBUS_TYPE_STRING, &value);
+}
+
+void modbus_msg_append_doubles(void* vmessage, const double* values, int n) {
+  ModbusMessage* message = (ModbusMessage*)vmessage;
+  DBusMessageIter array;
+  dbus_message_iter_open_container(&(message->dict), DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE_AS_STRING, &array);
+  dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_DOUBLE, &values, n);
+  dbus_message_iter_close_container(&(message->dict), &array);
+}
+
+/* reference numbers */
+
+static uint32_t name_hash(const char* s) {
+  return hash_string(2166136261u, s);
+}
+
+static void names_grow(ModbusNames* table) {
+  const uint32_t slots = table->slots;
+  char** names = table->names;
+  uint32_t* numbers = table->numbers;
+
+  table->slots = slots ? 2 * slots : 256;
+  table->names = (char**)calloc(table->slots, sizeof(char*));
+  table->numbers = (uint32_t*)malloc(table->slots * sizeof(uint32_t));
+  for (uint32_t i = 0; i < slots; i++) {
+    if (NULL == names[i])
+      continue;
+    uint32_t j = name_hash(names[i]) & (table->slots - 1);
+    while (table->names[j])
+      j = (j + 1) & (table->slots - 1);
+    table->names[j] = names[i];
+    table->numbers[j] = numbers[i];
+  }
+  free(names);
+  free(numbers);
+}
+
+/* the number of name, the next free one if it is added */
+static uint32_t names_number(ModbusNames* table, const char* name, int* added) {
+  if (2 * (table->used + 1) > table->slots)
+    names_grow(table);
+
+  uint32_t i = name_hash(name) & (table->slots - 1);
+  for (; table->names[i]; i = (i + 1) & (table->slots - 1))
+    if (0 == strcmp(table->names[i], name)) {
+      *added = 0;
+      return table->numbers[i];
+    }
+
+  *added = 1;
+  table->names[i] = strdup(name);
+  return table->numbers[i] = table->used++;
+}
+
+static void names_free(ModbusNames* table) {
+  for (uint32_t i = 0; i < table->slots; i++)
+    free(table->names[i]);
+  free(table->names);
+  free(table->numbers);
+}
+
+static char* copy(const char* s) {
+  return s ? strdup(s) : NULL;
+}
+
+void* modbus_frame_alloc(void* vconn, const char *target, const char* object, const char *interface, const char* method, double quantum) {
+  ModbusConnection* connection = (ModbusConnection*)vconn;
+  ModbusFrame* frame = (ModbusFrame*)calloc(1, sizeof(ModbusFrame));
+
+  frame->connection = connection;
+  frame->target = copy(target);
+  frame->object = copy(object);
+  frame->interface = copy(interface);
+  frame->method = copy(method);
+  frame->message.msg = NULL;
+  frame->quantum = quantum;
+  frame->stream = atomic_increment(&frame_streams);
+
+  lock(connection);
+  if (connection->frame)
+    fprintf(stderr, "Replacing the frame of the connection\n");
+  connection->frame = frame;
+  unlock(connection);
+  return frame;
+}
+
+/* start a call for records at time t */
+static void frame_open(ModbusFrame* frame, double t) {
+  msg_init(&(frame->message), frame->target, frame->object, frame->interface, frame->method, 0);
+  modbus_msg_add_double(&(frame->message), "t", t);
+
+  const char* name = "records";
+  const char* sig = DBUS_TYPE_ARRAY_AS_STRING
+    DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+    DBUS_TYPE_STRING_AS_STRING
+    DBUS_TYPE_STRING_AS_STRING
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_DOUBLE_AS_STRING
+    DBUS_STRUCT_END_CHAR_AS_STRING;
+
+  dbus_message_iter_open_container(&(frame->message.dict), DBUS_TYPE_DICT_ENTRY, 0, &(frame->entry));
+  dbus_message_iter_append_basic(&(frame->entry), DBUS_TYPE_STRING, &name);
+  dbus_message_iter_open_container(&(frame->entry), DBUS_TYPE_VARIANT, sig, &(frame->variant));
+  dbus_message_iter_open_container(&(frame->variant), DBUS_TYPE_ARRAY, sig + 1, &(frame->records));
+
+  frame->t = t;
+  frame->count = 0;
+
+  // a failed call may have lost records, this frame sends keys only
+  if (frame->resync) {
+    modbus_packed_resync(frame->sent, frame->references.used);
+    frame->resync = 0;
+  }
+}
+
+/* post the records collected so far, if any */
+static void frame_post(ModbusFrame* frame) {
+  if (NULL == frame->message.msg)
+    return;
+
+  dbus_message_iter_close_container(&(frame->variant), &(frame->records));
+  dbus_message_iter_close_container(&(frame->entry), &(frame->variant));
+  dbus_message_iter_close_container(&(frame->message.dict), &(frame->entry));
+
+  if (frame->packed_size > 0) {
+    const char* name = "packed";
+    const uint8_t* bytes = frame->packed;
+    DBusMessageIter entry, variant, array;
+    modbus_msg_add_double(&(frame->message), "quantum", frame->quantum);
+    modbus_msg_add_int(&(frame->message), "stream", (int)frame->stream);
+    dbus_message_iter_open_container(&(frame->message.dict), DBUS_TYPE_DICT_ENTRY, 0, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING, &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &bytes, (int)frame->packed_size);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(&(frame->message.dict), &entry);
+    frame->packed_size = 0;
+  }
+  dbus_message_iter_close_container(&(frame->message.args), &(frame->message.dict));
+
+  if (frame->connection)
+    post(frame->connection, frame->message.msg);
+  dbus_message_unref(frame->message.msg);
+  frame->message.msg = NULL;
+}
+
+/* append a record to the packed transforms (see modbus_wire.h), 0 if it goes in full */
+static int frame_pack(ModbusFrame* frame, const char* reference, const char* op, const double* values, int n) {
+  const int code = 3 == n && 0 == strcmp(op, "translation") ? MODBUS_OP_TRANSLATION :
+    9 == n && 0 == strcmp(op, "rotation_matrix") ? MODBUS_OP_ROTATION_MATRIX : -1;
+  int64_t value[3];
+  const int dropped = modbus_pack_values(code, values, frame->quantum, value);
+  if (dropped < 0)
+    return 0;
+
+  int added;
+  const uint32_t number = names_number(&(frame->references), reference, &added);
+  if (added) {
+    frame->sent = (ModbusPacked*)realloc(frame->sent, frame->references.slots * sizeof(ModbusPacked));
+    memset(&(frame->sent[number]), 0, sizeof(ModbusPacked));
+  }
+
+  const size_t length = strlen(reference);
+  if (frame->packed_size + length + MODBUS_PACKED_RECORD_BYTES > frame->packed_capacity) {
+    frame->packed_capacity = 2 * (frame->packed_size + length + MODBUS_PACKED_RECORD_BYTES);
+    frame->packed = (uint8_t*)realloc(frame->packed, frame->packed_capacity);
+  }
+
+  frame->packed_size += modbus_pack_record(frame->packed + frame->packed_size, &(frame->sent[number]), number,
+					   reference, length, code, value, dropped, MODBUS_KEYFRAME_INTERVAL);
+  return 1;
+}
+
+static void frame_add(ModbusFrame* frame, const char* reference, const char* op, double t, const double* values, int n) {
+  // a new time step or a full call starts the next one
+  if (frame->message.msg && (t != frame->t || MODBUS_FRAME_RECORDS == frame->count))
+    frame_post(frame);
+  if (NULL == frame->message.msg)
+    frame_open(frame, t);
+
+  if (frame->quantum > 0 && frame_pack(frame, reference, op, values, n)) {
+    frame->count++;
+    return;
+  }
+
+  DBusMessageIter record, array;
+  dbus_message_iter_open_container(&(frame->records), DBUS_TYPE_STRUCT, NULL, &record);
+  dbus_message_iter_append_basic(&record, DBUS_TYPE_STRING, &reference);
+  dbus_message_iter_append_basic(&record, DBUS_TYPE_STRING, &op);
+  dbus_message_iter_open_container(&record, DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE_AS_STRING, &array);
+  dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_DOUBLE, &values, n);
+  dbus_message_iter_close_container(&record, &array);
+  dbus_message_iter_close_container(&(frame->records), &record);
+
+  frame->count++;
+}
+
+void modbus_frame_add(void* vframe, const char* reference, const char* op, double t, const double* values, int n) {
+  ModbusFrame* frame = (ModbusFrame*)vframe;
+  ModbusConnection* connection = frame->connection;
+  lock(connection);
+  frame_add(frame, reference, op, t, values, n);
+  unlock(connection);
+}
+
+void modbus_frame_send(void* vframe) {
+  ModbusFrame* frame = (ModbusFrame*)vframe;
+  ModbusConnection* connection = frame->connection;
+  lock(connection);
+  frame_post(frame);
+  unlock(connection);
+}
+
+void modbus_frame_release(void* vframe) {
+  ModbusFrame* frame = (ModbusFrame*)vframe;
+  ModbusConnection* connection = frame->connection;
+  lock(connection);
+  frame_post(frame);
+  if (connection && frame == connection->frame)
+    connection->frame = NULL;
+  unlock(connection);
+
+  free(frame->target);
+  free(frame->object);
+  free(frame->interface);
+  free(frame->method);
+  names_free(&(frame->references));
+  free(frame->sent);
+  free(frame->packed);
+  free(frame);
+}
+
+/* shared memory rings */
+
+static void ring_detach(ModbusRingWriter* writer) {
+#ifndef _WIN32
+  modbus_ring_store(&(writer->ring->closed), 1);
+  munmap(writer->ring, writer->bytes);
+#endif
+  writer->ring = NULL;
+}
+
+/* wait until the reader took the records before until, gives up on a reader that stalls for seconds */
+static int ring_wait(ModbusRingWriter* writer, uint64_t until) {
+#ifndef _WIN32
+  const struct timespec pause = {0, 50000};
+  long waited = 0;
+  while (modbus_ring_load(&(writer->ring->tail)) < until) {
+    if (++waited > 200000) {
+      fprintf(stderr, "Shared memory reader stalled, sending frames instead\n");
+      ring_detach(writer);
+      return 0;
+    }
+    nanosleep(&pause, NULL);
+  }
+#endif
+  return 1;
+}
+
+static void ring_drain(ModbusRingWriter* writer) {
+  if (writer->ring)
+    ring_wait(writer, writer->head);
+}
+
+/* the next free record, NULL if the ring was given up */
+static ModbusRecord* ring_next(ModbusRingWriter* writer) {
+  ModbusRecord* record = modbus_ring_slot(writer->ring, writer->head);
+  if (NULL == record && ring_wait(writer, writer->head - writer->ring->capacity + 1))
+    record = modbus_ring_slot(writer->ring, writer->head);
+  return record;
+}
+
+static void ring_publish(ModbusRingWriter* writer) {
+  writer->head++;
+  modbus_ring_store(&(writer->ring->head), writer->head);
+}
+
+/* the number of a reference, sends its name records the first time */
+static int ring_reference(ModbusRingWriter* writer, const char* reference, uint32_t* number) {
+  int added;
+  *number = names_number(&(writer->references), reference, &added);
+  if (!added)
+    return 1;
+
+  const size_t length = strlen(reference);
+  size_t sent = 0, n;
+  do {
+    ModbusRecord* record = ring_next(writer);
+    if (NULL == record)
+      return 0;
+    n = modbus_ring_name(record, *number, reference, length, sent);
+    ring_publish(writer);
+    sent += n;
+  } while (MODBUS_RING_NAME_BYTES == n);
+  return 1;
+}
+
+static const char* const op_names[MODBUS_OPS] = {
+  "translation", "scale", "rotation_euler", "rotation_matrix", "material_property",
+  "ambient_color", "diffuse_color", "specular_color", "shape_parameter"
+};
+
+void* modbus_ring_alloc(void* vconn, const char *target, const char* object, const char *interface, const char* method, int capacity) {
+  ModbusConnection* connection = (ModbusConnection*)vconn;
+  ModbusRingWriter* writer = (ModbusRingWriter*)calloc(1, sizeof(ModbusRingWriter));
+  writer->connection = connection;
+  writer->target = copy(target);
+  writer->object = copy(object);
+  writer->interface = copy(interface);
+
+#ifndef _WIN32
+  static int segments = 0;
+  char path[64];
+  snprintf(path, sizeof(path), "/modbus-%ld-%d", (long)getpid(), __atomic_fetch_add(&segments, 1, __ATOMIC_RELAXED));
+
+  writer->bytes = MODBUS_RING_BYTES(capacity);
+  int fd = capacity > 0 ? shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600) : -1;
+  void* mem = MAP_FAILED;
+  if (fd >= 0) {
+    if (0 == ftruncate(fd, writer->bytes))
+      mem = mmap(NULL, writer->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mem)
+      shm_unlink(path);
+  }
+  if (MAP_FAILED != mem) {
+    writer->ring = (ModbusRing*)mem;
+    modbus_ring_init(writer->ring, capacity);
+
+    /* the handshake, a server that maps the segment answers with its path */
+    void* msg = modbus_msg_alloc(target, object, interface, method);
+    modbus_msg_add_string(msg, "path", path);
+    char* reply = (char*)modbus_connection_send_msg(connection, msg);
+    modbus_msg_release(msg);
+    shm_unlink(path);
+
+    if (0 != strcmp(reply, path))
+      ring_detach(writer);
+    free(reply);
+  }
+#endif
+  lock(connection);
+  connection->ring = writer;
+  unlock(connection);
+  return writer;
+}
+
+/* the typed call a record stands for (see modbus_msg_alloc_typed), 0 for ops without one */
+static int ring_call(ModbusRingWriter* writer, const char* reference, int code, double t, const double* values, int n) {
+  const char* method;
+  if (MODBUS_OP_TRANSLATION == code && 3 == n)
+    method = "set_translation";
+  else if (MODBUS_OP_SCALE == code && 3 == n)
+    method = "set_scale";
+  else if (MODBUS_OP_ROTATION_MATRIX == code && 9 == n)
+    method = "set_rotation_matrix";
+  else
+    return 0;
+
+  ModbusMessage* message = msg_new();
+  msg_init(message, writer->target, writer->object, writer->interface, method, 1);
+  modbus_msg_append_string(message, reference);
+  if (3 == n) {
+    for (int i = 0; i < 3; i++)
+      modbus_msg_append_double(message, values[i]);
+  } else {
+    modbus_msg_append_doubles(message, values, n);
+  }
+  modbus_msg_append_double(message, t);
+  msg_close(message);
+  post(writer->connection, message->msg);
+  modbus_msg_release(message);
+  return 1;
+}
+
+int modbus_ring_add(void* vring, const char* reference, const char* op, double t, const double* values, int n) {
+  ModbusRingWriter* writer = (ModbusRingWriter*)vring;
+  ModbusConnection* connection = writer->connection;
+
+  int code = 0;
+  while (code < MODBUS_OPS && strcmp(op_names[code], op))
+    code++;
+
+  uint32_t number;
+  ModbusRecord* record;
+  int status = 0;
+  lock(connection);
+  if (n < 0 || (n > 0 && NULL == values)) {
+    status = -1;
+  } else if (writer->ring && code < MODBUS_OPS && n <= MODBUS_RECORD_VALUES &&
+	     ring_reference(writer, reference, &number) && (record = ring_next(writer))) {
+    modbus_ring_record(record, number, code, t, values, n);
+    ring_publish(writer);
+  } else if (connection && connection->frame) {
+    frame_add(connection->frame, reference, op, t, values, n);
+  } else if (!connection || !ring_call(writer, reference, code, t, values, n)) {
+    status = -1;
+  }
+  if (status)
+    writer->lost++;
+  unlock(connection);
+  return status;
+}
+
+int modbus_ring_shared(void* vring) {
+  return NULL != ((ModbusRingWriter*)vring)->ring;
+}
+
+void modbus_ring_release(void* vring) {
+  ModbusRingWriter* writer = (ModbusRingWriter*)vring;
+  ModbusConnection* connection = writer->connection;
+  lock(connection);
+  if (writer->ring) {
+    ring_drain(writer);
+    if (writer->ring)
+      ring_detach(writer);
+  }
+  if (connection && writer == connection->ring)
+    connection->ring = NULL;
+  unlock(connection);
+
+  if (writer->lost > 0)
+    fprintf(stderr, "%lu records could not be sent\n", writer->lost);
+  free(writer->target);
+  free(writer->object);
+  free(writer->interface);
+  names_free(&(writer->references));
+  free(writer);
+}
+
 #ifdef __cplusplus
 }
 #endif
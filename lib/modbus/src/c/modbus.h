@@ -27,8 +27,26 @@ extern "C"
 {
 #endif
 
+/* asynchronous calls a connection keeps in flight before it waits for the oldest */
+#define MODBUS_WINDOW 256
+
+/* methods whose messages are copied from a prebuilt template, a power of two */
+#define MODBUS_TEMPLATES 256
+
+/* released message wrappers kept for reuse, the DBusMessage itself is allocated per message */
+#define MODBUS_POOL 64
+
+/* records of a frame before it is sent, even if the time step goes on */
+#define MODBUS_FRAME_RECORDS 4096
+
+/* packed records of a reference and op between two key records */
+#define MODBUS_KEYFRAME_INTERVAL 64
+
 void* modbus_acquire_session_bus(const char * client_name);
 
+/* a private bus gets a connection of its own, e.g. for one of several simulations in a process */
+void* modbus_acquire_bus(const char * client_name, int private_bus);
+
 void modbus_release_bus(void* conn);
 
 void* modbus_msg_alloc(const char *target, const char* object, const char *interface, const char* method);
@@ -41,8 +59,57 @@ void modbus_msg_add_int(void* msg, const char* name, int value);
 
 void modbus_msg_add_string(void* msg, const char* name, const char* value);
 
+/* typed messages: the arguments are appended in order into a single struct instead
+   of being put into a dictionary, for frequent calls with a fixed signature */
+void* modbus_msg_alloc_typed(const char *target, const char* object, const char *interface, const char* method);
+
+void modbus_msg_append_double(void* msg, double value);
+
+void modbus_msg_append_string(void* msg, const char* value);
+
+/* an array of n doubles, signature ad */
+void modbus_msg_append_doubles(void* msg, const double* values, int n);
+
+/* send a call and wait for its reply, the result has to be freed by the caller */
 const char* modbus_connection_send_msg(void* vconn, void* vmessage);
 
+/* send a call without waiting, its reply is only checked for errors (see modbus_connection_flush) */
+void modbus_connection_post_msg(void* vconn, void* vmessage);
+
+/* wait for all asynchronous calls, returns the number of those that failed so far */
+int modbus_connection_flush(void* vconn);
+
+/* frames: the updates of one time step as a single posted call of the given method,
+   with the arguments {"t": time, "records": [(reference, op, values), ...]}.
+   A frame is sent when a record of another time arrives, before any other call on
+   its connection and on flush or release. There is one frame per connection.
+   A positive quantum packs translations (to multiples of it) and rotation matrices
+   (as quaternions) into a few bytes each, see modbus_wire.h. */
+void* modbus_frame_alloc(void* vconn, const char *target, const char* object, const char *interface, const char* method, double quantum);
+
+void modbus_frame_release(void* vframe);
+
+void modbus_frame_add(void* vframe, const char* reference, const char* op, double t, const double* values, int n);
+
+void modbus_frame_send(void* vframe);
+
+/* shared memory: records of a local server go through a ring (see modbus_wire.h) of
+   capacity records, set up by a synchronous call of method with the segment's "path".
+   If the server does not answer with that path, capacity is 0 or the reader stalls,
+   the records go to the frame of the connection, without a frame translations, scales
+   and rotation matrices are posted as typed set_<op> calls. Synchronous calls and flush
+   wait until the server took all records. */
+void* modbus_ring_alloc(void* vconn, const char *target, const char* object, const char *interface, const char* method, int capacity);
+
+void modbus_ring_release(void* vring);
+
+/* 0 if the record was sent, -1 for a negative n or a record none of the above can take,
+   those are counted and reported on release */
+int modbus_ring_add(void* vring, const char* reference, const char* op, double t, const double* values, int n);
+
+/* 1 if the records go through shared memory */
+int modbus_ring_shared(void* vring);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,338 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+  Shared memory transport between a simulation (the writer, see
+  modbus_ring_alloc) and a local server (the reader, proc3d_attach_ring).
+
+  A segment holds a ModbusRing header followed by capacity fixed size
+  records. The writer only advances head, the reader only advances tail,
+  both count records and never wrap, the slot of a record is its number
+  modulo capacity. There are no locks, the counters are published with
+  release and read with acquire semantics.
+
+  References are sent once as name records, later records only carry the
+  number the name record gave them. A name longer than the values of one
+  record continues in the following name records, it ends with the first
+  record that is not full.
+ */
+
+#define MODBUS_RING_MAGIC 0x5244334du		/* "M3DR" */
+#define MODBUS_RING_VERSION 1
+#define MODBUS_RECORD_VALUES 9
+
+/* ops of a record, the values of proc3d_op_type */
+enum modbus_op {
+  MODBUS_OP_TRANSLATION,		/* x, y, z */
+  MODBUS_OP_SCALE,			/* x, y, z */
+  MODBUS_OP_ROTATION_EULER,		/* x, y, z */
+  MODBUS_OP_ROTATION_MATRIX,		/* row major */
+  MODBUS_OP_MATERIAL_PROPERTY,		/* not sent, the property is a name */
+  MODBUS_OP_AMBIENT_COLOR,		/* r, g, b, a */
+  MODBUS_OP_DIFFUSE_COLOR,
+  MODBUS_OP_SPECULAR_COLOR,
+  MODBUS_OP_SHAPE_PARAMETER,		/* parameter, value */
+  MODBUS_OPS,
+  MODBUS_OP_NAME = 0xffff		/* reference gets the name in values, count bytes */
+};
+
+typedef struct modbus_record {
+  uint32_t reference;
+  uint16_t op;
+  uint16_t count;			/* values used */
+  double t;
+  double values[MODBUS_RECORD_VALUES];
+} ModbusRecord;
+
+typedef struct modbus_ring {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;			/* records */
+  uint32_t record_size;			/* sizeof(ModbusRecord) of the writer */
+
+  /* the counters live on cache lines of their own */
+  char pad0[48];
+  uint64_t head;			/* records written */
+  char pad1[56];
+  uint64_t tail;			/* records read */
+  char pad2[56];
+  uint32_t closed;			/* set by the writer after its last record */
+  char pad3[60];
+
+  ModbusRecord records[1];		/* capacity records */
+} ModbusRing;
+
+#define MODBUS_RING_BYTES(capacity) (offsetof(ModbusRing, records) + (size_t)(capacity) * sizeof(ModbusRecord))
+
+#ifdef _MSC_VER
+#include <intrin.h>
+
+/* MSVC has no __atomic builtins, interlocked operations are full barriers. head and
+   tail have 64, closed has 32 bits, 64 bit stores go through a compare exchange for x86 */
+static inline uint64_t modbus_ring_load64(volatile void* p) {
+  return (uint64_t)_InterlockedCompareExchange64((volatile __int64*)p, 0, 0);
+}
+
+static inline void modbus_ring_store64(volatile void* p, uint64_t v) {
+  volatile __int64* q = (volatile __int64*)p;
+  __int64 seen = *q, old;
+  do {
+    old = seen;
+    seen = _InterlockedCompareExchange64(q, (__int64)v, old);
+  } while (seen != old);
+}
+
+#define modbus_ring_load(p) (sizeof(*(p)) == 8 ? modbus_ring_load64((p)) : \
+			     (uint64_t)(uint32_t)_InterlockedCompareExchange((volatile long*)(p), 0, 0))
+#define modbus_ring_store(p, v) (sizeof(*(p)) == 8 ? modbus_ring_store64((p), (v)) : \
+				 (void)_InterlockedExchange((volatile long*)(p), (long)(v)))
+#else
+#define modbus_ring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define modbus_ring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/* bytes of a name in one name record */
+#define MODBUS_RING_NAME_BYTES (MODBUS_RECORD_VALUES * sizeof(double))
+
+/* the header of a new segment of capacity records */
+static inline void modbus_ring_init(ModbusRing* ring, uint32_t capacity) {
+  ring->magic = MODBUS_RING_MAGIC;
+  ring->version = MODBUS_RING_VERSION;
+  ring->capacity = capacity;
+  ring->record_size = sizeof(ModbusRecord);
+}
+
+/* the slot of the record numbered head, NULL while the reader has not taken the one before it */
+static inline ModbusRecord* modbus_ring_slot(ModbusRing* ring, uint64_t head) {
+  if (head - modbus_ring_load(&(ring->tail)) >= ring->capacity)
+    return NULL;
+  return &(ring->records[head % ring->capacity]);
+}
+
+static inline void modbus_ring_record(ModbusRecord* record, uint32_t reference, int op, double t, const double* values, int n) {
+  record->reference = reference;
+  record->op = (uint16_t)op;
+  record->count = (uint16_t)n;
+  record->t = t;
+  memcpy(record->values, values, n * sizeof(double));
+}
+
+/* the name record of reference for the length bytes of name after sent, returns the bytes it took */
+static inline size_t modbus_ring_name(ModbusRecord* record, uint32_t reference, const char* name, size_t length, size_t sent) {
+  const size_t n = length - sent < MODBUS_RING_NAME_BYTES ? length - sent : MODBUS_RING_NAME_BYTES;
+  record->reference = reference;
+  record->op = MODBUS_OP_NAME;
+  record->count = (uint16_t)n;
+  record->t = 0.0;
+  memcpy(record->values, name + sent, n);
+  return n;
+}
+
+/*
+  Packed transforms, the "packed" byte array of a frame (see
+  modbus_frame_alloc). Every record is
+
+    varint   number of the reference, given by the writer
+    byte     MODBUS_OP_TRANSLATION or MODBUS_OP_ROTATION_MATRIX, or'ed with
+             MODBUS_PACKED_KEY and the quaternion component dropped << 5
+    [varint  length and the name of the reference, key records only]
+    3 varint zigzag coded values
+
+  A translation holds its coordinates in multiples of the quantum of the
+  frame, a rotation the three smaller components of its unit quaternion
+  in multiples of 1 / (sqrt(2) MODBUS_QUATERNION_STEPS), the largest one
+  is positive and follows from the unit length. Key records carry the
+  values, the others the difference to the last record of the reference
+  and op. A reader drops differences until it got a key record.
+
+  Reference numbers and last values belong to one stream, the sender of
+  the frames and the "stream" they carry. Every key record names its
+  reference again, a number that comes with another name starts over.
+  A reader that cannot decode the bytes answers the call with an error,
+  the next frame after an error reply holds key records only.
+ */
+
+#define MODBUS_PACKED_KEY 0x10
+#define MODBUS_QUATERNION_STEPS 32767
+#define MODBUS_QUATERNION_SCALE (1.4142135623730951 * MODBUS_QUATERNION_STEPS)
+
+static inline uint64_t modbus_zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t modbus_unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline size_t modbus_put_varint(uint8_t* p, uint64_t v) {
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7)
+    p[n++] = (uint8_t)(v | 0x80);
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+/* 0 if the varint does not end before end */
+static inline int modbus_get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v) {
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    const uint8_t b = *(*p)++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80)
+      return 1;
+  }
+  return 0;
+}
+
+/* the quantized smaller quaternion components of a row major rotation matrix, returns the dropped one (w, x, y, z) */
+static inline int modbus_matrix_quaternion(const double* m, int32_t* q) {
+  const double d[4] = {1 + m[0] + m[4] + m[8], 1 + m[0] - m[4] - m[8], 1 - m[0] + m[4] - m[8], 1 - m[0] - m[4] + m[8]};
+  int k = 0;
+  for (int i = 1; i < 4; i++)
+    if (d[i] > d[k])
+      k = i;
+
+  /* the largest component from the diagonal, the others from the off diagonal elements (Shepperd) */
+  const double r = 2 * sqrt(d[k]);
+  double c[4];
+  switch (k) {
+  case 0: c[0] = r / 4; c[1] = (m[7] - m[5]) / r; c[2] = (m[2] - m[6]) / r; c[3] = (m[3] - m[1]) / r; break;
+  case 1: c[1] = r / 4; c[0] = (m[7] - m[5]) / r; c[2] = (m[1] + m[3]) / r; c[3] = (m[2] + m[6]) / r; break;
+  case 2: c[2] = r / 4; c[0] = (m[2] - m[6]) / r; c[1] = (m[1] + m[3]) / r; c[3] = (m[5] + m[7]) / r; break;
+  default: c[3] = r / 4; c[0] = (m[3] - m[1]) / r; c[1] = (m[2] + m[6]) / r; c[2] = (m[5] + m[7]) / r; break;
+  }
+
+  for (int i = 0, j = 0; i < 4; i++)
+    if (i != k)
+      q[j++] = (int32_t)lrint(c[i] * MODBUS_QUATERNION_SCALE);
+  return k;
+}
+
+static inline void modbus_quaternion_matrix(int k, const int32_t* q, double* m) {
+  double c[4], sum = 0;
+  for (int i = 0, j = 0; i < 4; i++)
+    if (i != k) {
+      c[i] = q[j++] / MODBUS_QUATERNION_SCALE;
+      sum += c[i] * c[i];
+    }
+  c[k] = sum < 1 ? sqrt(1 - sum) : 0;
+
+  const double w = c[0], x = c[1], y = c[2], z = c[3];
+  m[0] = 1 - 2 * (y * y + z * z); m[1] = 2 * (x * y - w * z); m[2] = 2 * (x * z + w * y);
+  m[3] = 2 * (x * y + w * z); m[4] = 1 - 2 * (x * x + z * z); m[5] = 2 * (y * z - w * x);
+  m[6] = 2 * (x * z - w * y); m[7] = 2 * (y * z + w * x); m[8] = 1 - 2 * (x * x + y * y);
+}
+
+/* what the reader has of a reference, the last translation and rotation written */
+typedef struct modbus_packed {
+  int64_t position[3];
+  int32_t rotation[3];
+  int dropped;				/* the quaternion component left out */
+  int position_keys, rotation_keys;	/* differences to write before the next key record */
+} ModbusPacked;
+
+/* the most bytes of a record besides the name */
+#define MODBUS_PACKED_RECORD_BYTES 64
+
+/* whether the row major m is a rotation, others are not packed */
+static inline int modbus_is_rotation(const double* m) {
+  for (int i = 0; i < 3; i++)
+    for (int j = i; j < 3; j++) {
+      const double dot = m[3 * i] * m[3 * j] + m[3 * i + 1] * m[3 * j + 1] + m[3 * i + 2] * m[3 * j + 2];
+      if (!(fabs(dot - (i == j)) < 1e-6))
+	return 0;
+    }
+  return m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6]) + m[2] * (m[3] * m[7] - m[4] * m[6]) > 0;
+}
+
+/*
+  The three values of a record of op, MODBUS_OP_TRANSLATION (3 values) or
+  MODBUS_OP_ROTATION_MATRIX (9). Returns the dropped quaternion component,
+  0 for a translation, or -1 if the values cannot be packed.
+ */
+static inline int modbus_pack_values(int op, const double* values, double quantum, int64_t* value) {
+  if (MODBUS_OP_TRANSLATION == op) {
+    for (int i = 0; i < 3; i++) {
+      const double q = values[i] / quantum;
+      if (!(fabs(q) < 4e18))
+	return -1;
+      value[i] = llrint(q);
+    }
+    return 0;
+  }
+
+  if (MODBUS_OP_ROTATION_MATRIX != op || !modbus_is_rotation(values))
+    return -1;
+
+  int32_t q[3];
+  const int dropped = modbus_matrix_quaternion(values, q);
+  for (int i = 0; i < 3; i++)
+    value[i] = q[i];
+  return dropped;
+}
+
+/*
+  Write the record of the values of modbus_pack_values to p, at most
+  MODBUS_PACKED_RECORD_BYTES + length bytes, and remember them in last.
+  A key record goes out after interval differences of the reference and
+  op, or when the dropped component changes. Returns the bytes written.
+ */
+static inline size_t modbus_pack_record(uint8_t* p, ModbusPacked* last, uint32_t number, const char* name, size_t length,
+					int op, const int64_t* value, int dropped, int interval) {
+  const int translation = MODBUS_OP_TRANSLATION == op;
+  int* keys = translation ? &(last->position_keys) : &(last->rotation_keys);
+  const int key = 0 == *keys || (!translation && dropped != last->dropped);
+  *keys = key ? interval : *keys - 1;
+
+  uint8_t* const start = p;
+  p += modbus_put_varint(p, number);
+  *p++ = (uint8_t)(op | (key ? MODBUS_PACKED_KEY : 0) | (dropped << 5));
+  if (key) {
+    p += modbus_put_varint(p, length);
+    memcpy(p, name, length);
+    p += length;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    const int64_t previous = key ? 0 : translation ? last->position[i] : last->rotation[i];
+    p += modbus_put_varint(p, modbus_zigzag(value[i] - previous));
+    if (translation)
+      last->position[i] = value[i];
+    else
+      last->rotation[i] = (int32_t)value[i];
+  }
+  if (!translation)
+    last->dropped = dropped;
+  return (size_t)(p - start);
+}
+
+/* the next record of each of the n references is a key, e.g. after the reader may have lost some */
+static inline void modbus_packed_resync(ModbusPacked* sent, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++)
+    sent[i].position_keys = sent[i].rotation_keys = 0;
+}
@@ -19,43 +19,236 @@
   Main Author 2010-2013, Christoph Höger
  */
 
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <map>
 #include <queue>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 #include "operations.hpp"
+#include "nameRegistry.hpp"
+#include "trackStore.hpp"
+#include "timeline.hpp"
+#include "decimation.hpp"
+#include "ingest.hpp"
+#include "statistics.hpp"
 
 namespace proc3d {
-  
-  struct get_time : boost::static_visitor<double> {
-    template <typename T>
-    double operator()(const T& op) const {
-      return op.time;
+
+  class SpillWriter;
+  class RingReader;
+  class PackedReader;
+
+  class AnimationContext {
+  public:
+    /* the memory budget, retention and statistics are checked every that many keys */
+    static const std::size_t CHECK_INTERVAL = 4096;
+
+    AnimationContext() : budget(0), retention(0.0), pushed(0), retainedFrom(-std::numeric_limits<double>::infinity()) {}
+
+    NameRegistry registry;
+    NameRegistry properties;	// material property names
+    std::queue<SetupOperation> setupOps;
+    TrackStore tracks;
+    Timeline deltaOps;	// delta ops without a track
+    Decimator decimator;	// drops keys that playback can interpolate, off by default
+    std::vector<object_handle> batch;	// handles of a batched call by name, reused to avoid allocations
+
+    /*
+      Streaming to a recording (see recording.hpp): once keys and ops take
+      more than budget bytes, everything before the latest time stamp is
+      sealed and written by spill in the background.
+     */
+    std::size_t budget;	// 0 keeps everything in memory
+    boost::shared_ptr<SpillWriter> spill;
+
+    /*
+      Only keep the last retention seconds, older keys and ops are dropped
+      except for those that make up the state of every object. Ignored while
+      spilling, the recording has to stay complete.
+     */
+    double retention;	// 0 keeps everything
+
+    /*
+      Set to accept delta ops from several threads (see ingest.hpp). Producers
+      then go through ingest instead of push(), commit() merges their shards.
+     */
+    boost::shared_ptr<Ingest> ingest;
+
+    Statistics stats;
+
+    /* the values packed transforms of frames are relative to (see packed.hpp), by sender and stream */
+    std::map<std::pair<std::string, int>, boost::shared_ptr<PackedReader> > packed;
+
+    /*
+      Delta ops of a simulation on the same machine, read from shared memory
+      by a thread of its own (see ring.hpp), which goes through ingest. Declared
+      last, so it stops before anything it pushes to goes away.
+     */
+    boost::shared_ptr<RingReader> ring;
+
+    void push(const Move& op) {
+      const Channel<3>::value_type v = {{op.x, op.y, op.z}};
+      insert_translation(op.handle, op.time, v);
     }
-  };
 
-  static inline double time_of(const AnimOperation& op) {
-    return boost::apply_visitor( get_time(), op );
-  }
-  
-  struct compare_frames : boost::static_visitor<bool> {
-    template <typename T1, typename T2>
-    bool operator()(const T1& op1, const T2& op2) const {
-      return op1.time > op2.time;
+    void push(const Scale& op) {
+      const Channel<3>::value_type v = {{op.x, op.y, op.z}};
+      tracks[op.handle].scale.insert(op.time, v);
+      account(op_type<Scale>::value, op.handle);
     }
-  };
 
-  struct AnimationComparator {
-    bool operator()(const AnimOperation& op1, const AnimOperation& op2) const {
-      return boost::apply_visitor( compare_frames(), op1, op2 );
+    void push(const RotateMatrix& op) {
+      const rotation_matrix m = {{op.m(0,0), op.m(0,1), op.m(0,2),
+				  op.m(1,0), op.m(1,1), op.m(1,2),
+				  op.m(2,0), op.m(2,1), op.m(2,2)}};
+      insert_rotation(op.handle, op.time, m);
     }
-  };
 
-  typedef std::priority_queue<AnimOperation, std::vector<AnimOperation>, AnimationComparator> animation_queue;
-  class AnimationContext {
-  public:
-    std::queue<SetupOperation> setupOps;
-    animation_queue deltaOps;
+    void push(const SetAmbientColor& op) {
+      tracks[op.handle].ambient.insert(op.time, op.color);
+      account(op_type<SetAmbientColor>::value, op.handle);
+    }
+
+    void push(const SetDiffuseColor& op) {
+      tracks[op.handle].diffuse.insert(op.time, op.color);
+      account(op_type<SetDiffuseColor>::value, op.handle);
+    }
+
+    void push(const SetSpecularColor& op) {
+      tracks[op.handle].specular.insert(op.time, op.color);
+      account(op_type<SetSpecularColor>::value, op.handle);
+    }
+
+    void push(const RotateEuler& op) {
+      deltaOps.push(op);
+      account(op_type<RotateEuler>::value, op.handle);
+    }
 
+    void push(const SetMaterialProperty& op) {
+      deltaOps.push(op);
+      account(op_type<SetMaterialProperty>::value, op.handle);
+    }
+
+    void push(const SetShapeParameter& op) {
+      deltaOps.push(op);
+      account(op_type<SetShapeParameter>::value, op.handle);
+    }
+
+    /*
+      Transforms of n objects at one time stamp. positions holds 3, rotations
+      9 (row major) consecutive values per object, either may be NULL.
+     */
+    void push_transforms(const double time, const std::size_t n, const object_handle* handles,
+			 const double* positions, const double* rotations) {
+      Channel<3>::value_type p;
+      rotation_matrix m;
+
+      for (std::size_t i = 0; i < n; i++) {
+	if (positions) {
+	  std::copy(positions + 3 * i, positions + 3 * (i + 1), p.begin());
+	  insert_translation(handles[i], time, p);
+	}
+	if (rotations) {
+	  std::copy(rotations + 9 * i, rotations + 9 * (i + 1), m.begin());
+	  insert_rotation(handles[i], time, m);
+	}
+      }
+    }
+
+    /* merge late delta ops and the shards of concurrent producers, call before reading the context */
+    void commit() {
+      if (ingest)
+	ingest->drain(*this);
+      deltaOps.commit();
+    }
+
+    /* approximate memory held by keys and ops */
+    std::size_t memory() const {
+      return tracks.bytes() + deltaOps.bytes();
+    }
+
+    /* hand everything before the latest time stamp to spill (recording.cpp) */
+    void seal();
+
+    /* seal the rest and complete the spill file, returns false on I/O errors */
+    bool finish_spill();
+
+    /* wait until an attached ring is closed and read, so that nothing pushes anymore (proc3d.cpp) */
+    void finish_ring();
+
+    /* time of the first delta op, 0 if there is none */
+    double start_time() const {
+      const double t = std::min(tracks.start_time(), deltaOps.start_time());
+      return t == std::numeric_limits<double>::infinity() ? 0.0 : t;
+    }
+
+    /* time of the last delta op, 0 if there is none */
+    double end_time() const {
+      const double t = std::max(tracks.end_time(), deltaOps.end_time());
+      return t == -std::numeric_limits<double>::infinity() ? 0.0 : t;
+    }
+
+  private:
+    std::size_t pushed;	// keys since the last check
+    double retainedFrom;	// time of the last retention cut
+
+    void account(const int type, const object_handle handle) {
+      stats.count(type, handle);
+      if (++pushed < CHECK_INTERVAL)
+	return;
+
+      pushed = 0;
+      stats.sample(memory());
+      if (!budget && !(retention > 0.0))
+	return;
+
+      if (spill) {
+	if (memory() > budget)
+	  seal();
+      } else {
+	retain();
+      }
+    }
+
+    void retain() {
+      const double cut = std::max(tracks.end_time(), deltaOps.end_time()) - retention;
+
+      /* cutting copies everything that is kept, so only cut once a quarter of the window expired */
+      if (!(cut > retainedFrom + 0.25 * retention))
+	return;
+      retainedFrom = cut;
+
+      for (object_handle h = 0; h < tracks.size(); h++) {
+	ObjectTracks& obj = tracks[h];
+	obj.translation.drop_before(cut, 2);
+	obj.rotation.drop_before(cut, 2);
+	obj.scale.drop_before(cut, 1);
+	obj.ambient.drop_before(cut, 1);
+	obj.diffuse.drop_before(cut, 1);
+	obj.specular.drop_before(cut, 1);
+      }
+      deltaOps.drop_before(cut);
+    }
+
+    void insert_translation(const object_handle handle, const double time, const Channel<3>::value_type& v) {
+      decimator.insert_translation(tracks[handle].translation, handle, time, v);
+      account(op_type<Move>::value, handle);
+    }
+
+    /* rotations are converted to quaternions once, here */
+    void insert_rotation(const object_handle handle, const double time, const rotation_matrix& m) {
+      decimator.insert_rotation(tracks[handle].rotation, handle, time, quat_normalize(quat_from_matrix(m)));
+      account(op_type<RotateMatrix>::value, handle);
+    }
+
+  public:
     virtual void handleSignal(const int signal) {
     };
   };
@@ -0,0 +1,95 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace proc3d {
+
+  /*
+    Chunked bump allocator. Nothing is freed individually, all chunks go
+    at once with the arena, so storing many small payloads neither churns
+    the heap allocator nor fragments it.
+   */
+  class Arena {
+  public:
+    static const std::size_t CHUNK_SIZE = 64 * 1024;
+
+    Arena() : next(NULL), left(0) {}
+
+    ~Arena() {
+      clear();
+    }
+
+    void* allocate(std::size_t n) {
+      /* keep everything double aligned */
+      n = (n + sizeof(double) - 1) & ~(sizeof(double) - 1);
+      if (n > left) {
+	const std::size_t size = std::max(n, std::size_t(CHUNK_SIZE));
+	chunks.push_back(new double[size / sizeof(double)]);
+	next = (char*) chunks.back();
+	left = size;
+      }
+
+      void* const p = next;
+      next += n;
+      left -= n;
+      return p;
+    }
+
+    /* copy of s that lives as long as the arena */
+    boost::string_ref copy(const boost::string_ref s) {
+      char* const p = (char*) allocate(s.size() + 1);
+      memcpy(p, s.data(), s.size());
+      p[s.size()] = 0;
+      return boost::string_ref(p, s.size());
+    }
+
+    void clear() {
+      for (std::vector<double*>::iterator i = chunks.begin(); i != chunks.end(); i++)
+	delete[] *i;
+      chunks.clear();
+      next = NULL;
+      left = 0;
+    }
+
+    void swap(Arena& other) {
+      chunks.swap(other.chunks);
+      std::swap(next, other.next);
+      std::swap(left, other.left);
+    }
+
+  private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    std::vector<double*> chunks;
+    char* next;
+    std::size_t left;
+  };
+
+}
@@ -0,0 +1,131 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "operations.hpp"
+#include "rotations.hpp"
+#include "trackStore.hpp"
+
+namespace proc3d {
+
+  /* zero disables decimation */
+  struct Tolerance {
+    Tolerance() : position(0.0), angle(0.0) {}
+    double position;	// max. distance
+    double angle;	// max. rotation angle in rad
+
+    bool enabled() const { return position > 0.0 || angle > 0.0; }
+  };
+
+  /*
+    Online keyframe decimation. A new key replaces the last key of a channel
+    if interpolating between the key before and the new one reproduces the
+    last key and every key it replaced before within the tolerance.
+   */
+  class Decimator {
+  public:
+    /* bounds the work per key, a segment is closed after that many dropped keys */
+    static const std::size_t MAX_DROPPED = 64;
+
+    Tolerance tolerance;
+
+    void insert_translation(Channel<3>& channel, const object_handle handle, const double t, const Channel<3>::value_type& v) {
+      if (tolerance.position > 0.0)
+	insert(channel, state(handle).translation, t, v, lerp<3>, translation_error, tolerance.position);
+      else
+	channel.insert(t, v);
+    }
+
+    void insert_rotation(Channel<4>& channel, const object_handle handle, const double t, const quaternion& q) {
+      if (tolerance.angle > 0.0)
+	insert(channel, state(handle).rotation, t, q, slerp, quat_angle, tolerance.angle);
+      else
+	channel.insert(t, q);
+    }
+
+  private:
+    template <std::size_t N>
+    struct Dropped {
+      std::vector<double> times;
+      std::vector<typename Channel<N>::value_type> values;
+
+      void clear() { times.clear(); values.clear(); }
+    };
+
+    struct ObjectState {
+      Dropped<3> translation;
+      Dropped<4> rotation;
+    };
+
+    std::vector<ObjectState> objects;
+
+    ObjectState& state(const object_handle handle) {
+      if (handle >= objects.size())
+	objects.resize(handle + 1);
+      return objects[handle];
+    }
+
+    static double translation_error(const Channel<3>::value_type& expected, const Channel<3>::value_type& v) {
+      const double dx = expected[0] - v[0], dy = expected[1] - v[1], dz = expected[2] - v[2];
+      return std::sqrt(dx*dx + dy*dy + dz*dz);
+    }
+
+    template <std::size_t N, typename Interpolation, typename Error>
+    static void insert(Channel<N>& channel, Dropped<N>& dropped, const double t, const typename Channel<N>::value_type& v,
+		       Interpolation interpolate, Error error, const double tolerance) {
+      const std::size_t n = channel.size();
+
+      /* only in order keys are decimated, the key before the last one is the anchor */
+      if (n >= 2 && channel.times[n - 1] <= t && channel.times[n - 2] < t && dropped.times.size() < MAX_DROPPED) {
+	const double t0 = channel.times[n - 2];
+	const typename Channel<N>::value_type anchor = channel.value(n - 2);
+	const typename Channel<N>::value_type last = channel.value(n - 1);
+
+	bool fits = fits_segment<N>(anchor, t0, v, t, channel.times[n - 1], last, interpolate, error, tolerance);
+	for (std::size_t i = 0; fits && i < dropped.times.size(); i++)
+	  fits = fits_segment<N>(anchor, t0, v, t, dropped.times[i], dropped.values[i], interpolate, error, tolerance);
+
+	if (fits) {
+	  dropped.times.push_back(channel.times[n - 1]);
+	  dropped.values.push_back(last);
+	  channel.replace_last(t, v);
+	  return;
+	}
+      }
+
+      dropped.clear();
+      channel.insert(t, v);
+    }
+
+    template <std::size_t N, typename Interpolation, typename Error>
+    static bool fits_segment(const typename Channel<N>::value_type& a, const double ta,
+			     const typename Channel<N>::value_type& b, const double tb,
+			     const double t, const typename Channel<N>::value_type& v,
+			     Interpolation interpolate, Error error, const double tolerance) {
+      return error(interpolate(a, b, (t - ta) / (tb - ta)), v) <= tolerance;
+    }
+  };
+
+}
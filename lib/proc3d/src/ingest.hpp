@@ -0,0 +1,220 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "operations.hpp"
+#include "nameRegistry.hpp"
+#include "timeline.hpp"
+
+namespace proc3d {
+
+  /* delta ops of one producer thread, in the order they were pushed */
+  struct Shard {
+    typedef std::unordered_map<boost::string_ref, object_handle, hash_name> NameCache;
+
+    std::mutex mutex;	// only contended while the shard is merged
+    std::vector<double> times;
+    std::vector<AnimOperation> ops;
+
+    /* registry lookups of this thread, keys point into the registry's arena */
+    NameCache names;
+    NameCache properties;
+    std::vector<object_handle> batch;	// see AnimationContext::batch
+  };
+
+  /*
+    Concurrent ingestion into one AnimationContext. Every producer thread
+    appends to its own shard, so producers only share a lock when they meet
+    a name for the first time or when a full shard is merged. Merging feeds
+    the ops of all given shards to the context in time order, the context
+    itself is only touched under the merge lock.
+   */
+  class Ingest {
+  public:
+    /* a producer merges its shard once it holds that many ops */
+    static const std::size_t FLUSH_SIZE = 4096;
+
+    Ingest() : serial(next_serial()), interned(0) {}
+
+    /* the shard of the calling thread */
+    Shard& shard() {
+      static thread_local unsigned long owner = 0;
+      static thread_local Shard* cached = NULL;
+      if (owner == serial)
+	return *cached;
+
+      std::lock_guard<std::mutex> lock(shardsMutex);
+      std::map<std::thread::id, Shard*>::iterator i = byThread.find(std::this_thread::get_id());
+      if (i == byThread.end()) {
+	shards.push_back(new Shard());
+	i = byThread.insert(std::make_pair(std::this_thread::get_id(), shards.back())).first;
+      }
+      owner = serial;
+      cached = i->second;
+      return *cached;
+    }
+
+    /* handle of name in registry, only locks for names this thread has not seen yet */
+    object_handle handle(NameRegistry& registry, const boost::string_ref name) {
+      return handle(registry, shard().names, name);
+    }
+
+    object_handle property(NameRegistry& properties, const boost::string_ref name) {
+      return handle(properties, shard().properties, name);
+    }
+
+    /* anything else that touches the shared context outside of delta ops (setup ops) */
+    std::mutex& setup() { return namesMutex; }
+
+    /* held while shards are merged, readers of the context's counters take it too */
+    std::mutex& merge_lock() { return merging; }
+
+    /* whether h was handed out by registry, only locks for handles newer than the last check */
+    bool known(const NameRegistry& registry, const object_handle h) {
+      if (h < interned.load())
+	return true;
+      std::lock_guard<std::mutex> lock(namesMutex);
+      interned = registry.size();
+      return h < registry.size();
+    }
+
+    template <typename Context>
+    void push(Context& context, const AnimOperation& op) {
+      Shard& s = shard();
+      std::size_t n;
+      {
+	std::lock_guard<std::mutex> lock(s.mutex);
+	s.times.push_back(time_of(op));
+	s.ops.push_back(op);
+	n = s.ops.size();
+      }
+
+      if (n >= FLUSH_SIZE) {
+	std::lock_guard<std::mutex> lock(merging);
+	Shard* const one[] = {&s};
+	merge(context, one, one + 1);
+      }
+    }
+
+    /* merge all shards into context, call before reading the context */
+    template <typename Context>
+    void drain(Context& context) {
+      std::vector<Shard*> all;
+      {
+	std::lock_guard<std::mutex> lock(shardsMutex);
+	all.assign(shards.begin(), shards.end());
+      }
+
+      std::lock_guard<std::mutex> lock(merging);
+      merge(context, all.data(), all.data() + all.size());
+    }
+
+    ~Ingest() {
+      for (std::list<Shard*>::iterator i = shards.begin(); i != shards.end(); i++)
+	delete *i;
+    }
+
+  private:
+    Ingest(const Ingest&);
+    Ingest& operator=(const Ingest&);
+
+    static unsigned long next_serial() {
+      static std::atomic<unsigned long> instances(0);
+      return ++instances;
+    }
+
+    const unsigned long serial;	// tells the thread local shard caches of different contexts apart
+
+    std::mutex shardsMutex;
+    std::list<Shard*> shards;
+    std::map<std::thread::id, Shard*> byThread;
+
+    std::mutex namesMutex;
+    std::atomic<std::size_t> interned;	// registry size at the last known() that locked
+    std::mutex merging;	// lock order: merging, then shard
+
+    object_handle handle(NameRegistry& registry, Shard::NameCache& cache, const boost::string_ref name) {
+      const Shard::NameCache::const_iterator i = cache.find(name);
+      if (i != cache.end())
+	return i->second;
+
+      std::lock_guard<std::mutex> lock(namesMutex);
+      const object_handle h = registry.intern(name);
+      cache.insert(std::make_pair(registry.name(h), h));
+      return h;
+    }
+
+    template <typename Context>
+    struct pusher : boost::static_visitor<> {
+      Context& context;
+      pusher(Context& c) : context(c) {}
+
+      template <typename Op>
+      void operator()(const Op& op) const {
+	context.push(op);
+      }
+    };
+
+    /* k-way merge by time, ties are taken in shard order */
+    template <typename Context>
+    void merge(Context& context, Shard* const* first, Shard* const* last) {
+      const std::size_t k = last - first;
+      std::vector<std::unique_lock<std::mutex> > locks;
+      std::vector<std::size_t> next(k, 0);
+      for (std::size_t s = 0; s < k; s++)
+	locks.push_back(std::unique_lock<std::mutex>(first[s]->mutex));
+
+      const pusher<Context> push(context);
+      for (;;) {
+	std::size_t best = k;
+	double t = std::numeric_limits<double>::infinity();
+	for (std::size_t s = 0; s < k; s++) {
+	  if (next[s] < first[s]->times.size() && (best == k || first[s]->times[next[s]] < t)) {
+	    best = s;
+	    t = first[s]->times[next[s]];
+	  }
+	}
+	if (best == k)
+	  break;
+
+	boost::apply_visitor(push, first[best]->ops[next[best]++]);
+      }
+
+      for (std::size_t s = 0; s < k; s++) {
+	first[s]->times.clear();
+	first[s]->ops.clear();
+      }
+    }
+  };
+
+}
@@ -0,0 +1,197 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include <boost/array.hpp>
+
+#include "operations.hpp"
+#include "rotations.hpp"
+
+/* no aliasing between kernel arguments, lets the compiler vectorize without runtime checks */
+#if defined(__GNUC__)
+#define PROC3D_RESTRICT __restrict__
+#elif defined(_MSC_VER)
+#define PROC3D_RESTRICT __restrict
+#else
+#define PROC3D_RESTRICT
+#endif
+
+namespace proc3d {
+
+  /*
+    Interpolation of many objects at once. The keys around the render time
+    are gathered into one array per component (structure of arrays) and
+    evaluated by plain loops without branches or calls, which the compiler
+    turns into SIMD code. Rotations use the polynomial form of slerp by
+    D. Eberly ("A Fast and Accurate Algorithm for Computing SLERP"), which
+    needs no trigonometry.
+   */
+
+  /* out = a + alpha * (b - a) */
+  static inline void lerp_n(const std::size_t n, const double* a, const double* b, const double* alpha, double* out) {
+    for (std::size_t i = 0; i < n; i++)
+      out[i] = a[i] + alpha[i] * (b[i] - a[i]);
+  }
+
+  /*
+    The series of sin(alpha * omega) / sin(omega) in cos(omega), cut after
+    SLERP_TERMS terms. For cos(omega) >= SLERP_MIN_COS (keys up to ~90 degrees
+    apart) the error is below 1e-8, wider spans are done by slerp() instead.
+   */
+  static const int SLERP_TERMS = 8;
+  static const double SLERP_MIN_COS = 0.7;
+
+  /* the series for every pair, the arrays must not overlap */
+  static inline void slerp_series(const std::size_t n,
+				  const double* PROC3D_RESTRICT ax, const double* PROC3D_RESTRICT ay,
+				  const double* PROC3D_RESTRICT az, const double* PROC3D_RESTRICT aw,
+				  const double* PROC3D_RESTRICT bx, const double* PROC3D_RESTRICT by,
+				  const double* PROC3D_RESTRICT bz, const double* PROC3D_RESTRICT bw,
+				  const double* PROC3D_RESTRICT alpha,
+				  double* PROC3D_RESTRICT ox, double* PROC3D_RESTRICT oy,
+				  double* PROC3D_RESTRICT oz, double* PROC3D_RESTRICT ow) {
+    for (std::size_t i = 0; i < n; i++) {
+      const double dot = ax[i] * bx[i] + ay[i] * by[i] + az[i] * bz[i] + aw[i] * bw[i];
+      const double sign = dot < 0.0 ? -1.0 : 1.0;
+      const double xm1 = sign * dot - 1.0;
+
+      const double t = alpha[i], d = 1.0 - t;
+      double ct = 1.0, cd = 1.0;
+      for (int k = SLERP_TERMS; k >= 1; k--) {
+	const double u = 1.0 / (k * (2.0 * k + 1.0)), v = k / (2.0 * k + 1.0);
+	ct = 1.0 + (u * t * t - v) * xm1 * ct;
+	cd = 1.0 + (u * d * d - v) * xm1 * cd;
+      }
+      ct *= sign * t;
+      cd *= d;
+
+      ox[i] = cd * ax[i] + ct * bx[i];
+      oy[i] = cd * ay[i] + ct * by[i];
+      oz[i] = cd * az[i] + ct * bz[i];
+      ow[i] = cd * aw[i] + ct * bw[i];
+    }
+  }
+
+  /* slerp of n quaternion pairs, components in separate arrays */
+  static inline void slerp_n(const std::size_t n, const double* const a[4], const double* const b[4],
+			     const double* alpha, double* const out[4]) {
+    const double *ax = a[0], *ay = a[1], *az = a[2], *aw = a[3];
+    const double *bx = b[0], *by = b[1], *bz = b[2], *bw = b[3];
+    double *ox = out[0], *oy = out[1], *oz = out[2], *ow = out[3];
+
+    slerp_series(n, ax, ay, az, aw, bx, by, bz, bw, alpha, ox, oy, oz, ow);
+
+    /* the rare wide spans */
+    for (std::size_t i = 0; i < n; i++) {
+      const double dot = ax[i] * bx[i] + ay[i] * by[i] + az[i] * bz[i] + aw[i] * bw[i];
+      if (dot < SLERP_MIN_COS && dot > -SLERP_MIN_COS) {
+	const quaternion p = {{ax[i], ay[i], az[i], aw[i]}}, q = {{bx[i], by[i], bz[i], bw[i]}};
+	const quaternion r = slerp(p, q, alpha[i]);
+	ox[i] = r[0]; oy[i] = r[1]; oz[i] = r[2]; ow[i] = r[3];
+      }
+    }
+  }
+
+  /*
+    Pairs of N component keys and their interpolation parameter, gathered
+    for one render time. Keeps its memory between frames.
+   */
+  template <std::size_t N>
+  class Spans {
+  public:
+    typedef boost::array<double, N> value_type;
+
+    Spans() : count(0) {}
+
+    void clear() {
+      count = 0;
+    }
+
+    void add(const object_handle h, const value_type& a, const value_type& b, const double t) {
+      if (count == handles.size())
+	grow();
+
+      handles[count] = h;
+      alpha[count] = t;
+      for (std::size_t c = 0; c < N; c++) {
+	from[c][count] = a[c];
+	to[c][count] = b[c];
+      }
+      count++;
+    }
+
+    std::size_t size() const { return count; }
+
+    /* component wise linear interpolation, the result replaces the first keys */
+    void lerp() {
+      for (std::size_t c = 0; c < N; c++)
+	lerp_n(size(), from[c].data(), to[c].data(), alpha.data(), from[c].data());
+    }
+
+    /* quaternion slerp (N == 4), the result replaces the first keys */
+    void slerp() {
+      const double* a[4];
+      const double* b[4];
+      double* out[4];
+      for (std::size_t c = 0; c < 4; c++) {
+	a[c] = from[c].data();
+	b[c] = to[c].data();
+	out[c] = result[c].data();
+      }
+      slerp_n(size(), a, b, alpha.data(), out);
+      for (std::size_t c = 0; c < 4; c++)
+	from[c].swap(result[c]);
+    }
+
+    object_handle handle(const std::size_t i) const { return handles[i]; }
+
+    /* the interpolated value of pair i */
+    value_type value(const std::size_t i) const {
+      value_type v;
+      for (std::size_t c = 0; c < N; c++)
+	v[c] = from[c][i];
+      return v;
+    }
+
+  private:
+    std::size_t count;
+    std::vector<object_handle> handles;	// all arrays have the same size, count of them are used
+    std::vector<double> alpha;
+    std::vector<double> from[N], to[N], result[N];
+
+    void grow() {
+      const std::size_t n = std::max<std::size_t>(64, 2 * handles.size());
+      handles.resize(n);
+      alpha.resize(n);
+      for (std::size_t c = 0; c < N; c++) {
+	from[c].resize(n);
+	to[c].resize(n);
+	result[c].resize(n);
+      }
+    }
+  };
+
+}
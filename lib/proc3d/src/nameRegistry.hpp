@@ -0,0 +1,105 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "arena.hpp"
+#include "operations.hpp"
+
+namespace proc3d {
+
+  /* hashes a name without copying it */
+  struct hash_name {
+    std::size_t operator()(const boost::string_ref s) const {
+      return boost::hash_range(s.begin(), s.end());
+    }
+  };
+
+  /*
+    Interns object and material names. Every name is assigned a dense handle
+    on first sight, so delta operations only need to carry an integer and
+    backends can keep their per-object state in plain vectors. The names
+    live in an arena and are looked up without copying them, so resolving
+    a name that is already known allocates nothing.
+   */
+  class NameRegistry {
+  public:
+    NameRegistry() {}
+
+    NameRegistry(const NameRegistry& other) {
+      for (object_handle h = 0; h < other.size(); h++)
+	intern(other.name(h));
+    }
+
+    NameRegistry& operator=(const NameRegistry& other) {
+      if (this != &other) {
+	NameRegistry copy(other);
+	arena.swap(copy.arena);
+	handles.swap(copy.handles);
+	names.swap(copy.names);
+      }
+      return *this;
+    }
+
+    object_handle intern(const boost::string_ref name) {
+      const auto it = handles.find(name);
+      if (it != handles.end())
+	return it->second;
+
+      const object_handle handle = names.size();
+      const boost::string_ref stored = arena.copy(name);
+      names.push_back(stored);
+      handles.insert(std::make_pair(stored, handle));
+      return handle;
+    }
+
+    bool lookup(const boost::string_ref name, object_handle& handle) const {
+      const auto it = handles.find(name);
+      if (it == handles.end())
+	return false;
+
+      handle = it->second;
+      return true;
+    }
+
+    /* zero terminated, valid as long as the registry */
+    boost::string_ref name(const object_handle handle) const {
+      return names[handle];
+    }
+
+    std::size_t size() const {
+      return names.size();
+    }
+
+  private:
+    Arena arena;
+    std::unordered_map<boost::string_ref, object_handle, hash_name> handles;
+    std::vector<boost::string_ref> names;
+  };
+
+}
@@ -30,6 +30,9 @@ namespace proc3d {
   using namespace boost; //array, variant
   using namespace boost::numeric::ublas; //bounded_matrix
 
+  /* dense integer handle of an interned object or material name */
+  typedef unsigned int object_handle;
+
   struct ObjectOperation {
     ObjectOperation(const std::string& name) : name(name) {}
     std::string name;
@@ -93,64 +96,113 @@ namespace proc3d {
     double width;
   };
 
-  struct DeltaOperation : ObjectOperation {
-    DeltaOperation(const std::string& name, const double t) : ObjectOperation(name), time(t) {}
+  /*
+    The parameters of the parametric shapes, named and meant like those of
+    the Modelica shapes. They may change during the animation (see
+    SetShapeParameter), the geometry then follows.
+   */
+  enum ShapeParameter {
+    SHAPE_LENGTH,	// along at
+    SHAPE_WIDTH,	// outer diameter
+    SHAPE_HEIGHT,	// spring: diameter of the wire
+    SHAPE_EXTRA,	// spring: windings, pipe: inner / outer diameter, gearwheel: teeth
+    SHAPE_PARAMETERS
+  };
+
+  struct ParametricShapeOperation : ObjectOperation {
+    ParametricShapeOperation(const std::string& name, const double l, const double w, const double h, const double e,
+			     const array<double, 3>& a) : ObjectOperation(name), at(a) {
+      parameters[SHAPE_LENGTH] = l; parameters[SHAPE_WIDTH] = w; parameters[SHAPE_HEIGHT] = h; parameters[SHAPE_EXTRA] = e;
+    }
+    array<double, SHAPE_PARAMETERS> parameters;
+    array<double, 3> at;
+  };
+
+  struct CreateSpring : ParametricShapeOperation {
+    CreateSpring(const std::string& name, const double l, const double w, const double h, const double windings, const array<double, 3>& a) :
+      ParametricShapeOperation(name, l, w, h, windings, a) {}
+  };
+
+  struct CreatePipe : ParametricShapeOperation {
+    CreatePipe(const std::string& name, const double l, const double w, const double ratio, const array<double, 3>& a) :
+      ParametricShapeOperation(name, l, w, 0.0, ratio, a) {}
+  };
+
+  struct CreateGearwheel : ParametricShapeOperation {
+    CreateGearwheel(const std::string& name, const double l, const double w, const double teeth, const array<double, 3>& a) :
+      ParametricShapeOperation(name, l, w, 0.0, teeth, a) {}
+  };
+
+  struct DeltaOperation {
+    DeltaOperation(const object_handle h, const double t) : handle(h), time(t) {}
+    object_handle handle;
     double time;
   };
     
   struct Move : DeltaOperation {
-    Move(const std::string& name, const double t, const double x, const double y, const double z) : DeltaOperation(name, t), x(x), y(y), z(z) {}
+    Move(const object_handle h, const double t, const double x, const double y, const double z) : DeltaOperation(h, t), x(x), y(y), z(z) {}
     double x,y,z;
   };
 
   struct Scale : DeltaOperation {
-    Scale(const std::string& name, const double t, const double x, const double y, const double z) : DeltaOperation(name, t), x(x), y(y), z(z) {}
+    Scale(const object_handle h, const double t, const double x, const double y, const double z) : DeltaOperation(h, t), x(x), y(y), z(z) {}
     double x,y,z;
   };
 
   struct RotateEuler : DeltaOperation {
-    RotateEuler(const std::string& name, const double t, const double x, const double y, const double z) : DeltaOperation(name, t), x(x), y(y), z(z) {}
+    RotateEuler(const object_handle h, const double t, const double x, const double y, const double z) : DeltaOperation(h, t), x(x), y(y), z(z) {}
     double x,y,z;
   };
 
   struct RotateMatrix : DeltaOperation {
-    RotateMatrix(const std::string& name, const double t, const bounded_matrix<double, 3, 3>& m) : DeltaOperation(name, t), m(m) {}
+    RotateMatrix(const object_handle h, const double t, const bounded_matrix<double, 3, 3>& m) : DeltaOperation(h, t), m(m) {}
     bounded_matrix<double, 3, 3> m;
   };
 
   struct SetMaterialProperty : DeltaOperation {
-    SetMaterialProperty(const std::string& name, const double t, const std::string& p, const double v) : DeltaOperation(name, t), property(p), value(v) {}
-    std::string property;
+    SetMaterialProperty(const object_handle h, const double t, const object_handle p, const double v) : DeltaOperation(h, t), property(p), value(v) {}
+    object_handle property;	// interned in AnimationContext::properties
     double value;
   };
 
   struct SetAmbientColor : DeltaOperation {
-    SetAmbientColor(const std::string& name, const double t,
+    SetAmbientColor(const object_handle h, const double t,
 		    const double r, const double g, const double b, const double a) : 
-      DeltaOperation(name, t) {color[0] = r;color[1] = g;color[2] = b;color[3] = a;}
+      DeltaOperation(h, t) {color[0] = r;color[1] = g;color[2] = b;color[3] = a;}
       array<double, 4> color;
   };
 
   struct SetDiffuseColor : DeltaOperation {
-    SetDiffuseColor(const std::string& name, const double t,
+    SetDiffuseColor(const object_handle h, const double t,
 		    const double r, const double g, const double b, const double a) : 
-      DeltaOperation(name, t){color[0] = r;color[1] = g;color[2] = b;color[3] = a;}
+      DeltaOperation(h, t){color[0] = r;color[1] = g;color[2] = b;color[3] = a;}
       array<double, 4> color;
   };
 
   struct SetSpecularColor : DeltaOperation {
-    SetSpecularColor(const std::string& name, const double t,
+    SetSpecularColor(const object_handle h, const double t,
 		     const double r, const double g, const double b, const double a) : 
-      DeltaOperation(name, t){color[0] = r;color[1] = g;color[2] = b;color[3] = a;}
+      DeltaOperation(h, t){color[0] = r;color[1] = g;color[2] = b;color[3] = a;}
       array<double, 4> color;
   };
 
+  /* one parameter of a parametric shape, the geometry is updated in place */
+  struct SetShapeParameter : DeltaOperation {
+    SetShapeParameter(const object_handle h, const double t, const unsigned int p, const double v) : DeltaOperation(h, t), parameter(p), value(v) {}
+    unsigned int parameter;	// ShapeParameter
+    double value;
+  };
+
   typedef variant<CreateGroup, CreateSphere, CreateBox, 
 		  CreateCylinder, CreateCone, CreatePlane,
-		  LoadObject, AddToGroup, CreateMaterial, ApplyMaterial> SetupOperation;
+		  LoadObject, AddToGroup, CreateMaterial, ApplyMaterial,
+		  CreateSpring, CreatePipe, CreateGearwheel> SetupOperation;
 
   typedef variant<Move, Scale, RotateEuler, RotateMatrix, SetMaterialProperty, 
-		  SetAmbientColor, SetDiffuseColor, SetSpecularColor> AnimOperation;
+		  SetAmbientColor, SetDiffuseColor, SetSpecularColor, SetShapeParameter> AnimOperation;
+
+  /* the delta ops that are not stored in a keyframe track, fixed size records */
+  typedef variant<RotateEuler, SetMaterialProperty, SetShapeParameter> TimelineOperation;
   
 }
 
@@ -0,0 +1,120 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "operations.hpp"
+#include "modbus_wire.h"
+
+namespace proc3d {
+
+  /*
+    Reader of the packed transforms of one stream of frames (see
+    modbus_wire.h). It keeps the last values of every reference number of
+    the writer, each record is handed to apply as the full translation or
+    rotation matrix it stands for.
+   */
+  class PackedReader {
+  public:
+    /* reference numbers beyond are taken for garbage, as in RingReader */
+    static const uint64_t MAX_REFERENCES = 1 << 20;
+
+    typedef std::function<object_handle (const std::string&)> Intern;
+    typedef std::function<void (const object_handle, const ModbusRecord&)> Apply;
+
+    /* false if the bytes end within a record or hold a bad one, the records before are applied */
+    bool read(const uint8_t* p, const uint8_t* end, const double t, const double quantum,
+	      const Intern& intern, const Apply& apply) {
+      ModbusRecord record;
+      record.t = t;
+
+      while (p < end) {
+	uint64_t number, length, v[3];
+	if (!modbus_get_varint(&p, end, &number) || p == end)
+	  return false;
+	const uint8_t header = *p++;
+	const int op = header & 0x0f, dropped = (header >> 5) & 3;
+	const bool key = header & MODBUS_PACKED_KEY;
+	if (op != MODBUS_OP_TRANSLATION && op != MODBUS_OP_ROTATION_MATRIX)
+	  return false;
+
+	if (number >= MAX_REFERENCES)
+	  return false;
+	if (number >= bodies.size())
+	  bodies.resize(number + 1);
+	Body& body = bodies[number];
+	if (key) {
+	  if (!modbus_get_varint(&p, end, &length) || length > uint64_t(end - p))
+	    return false;
+	  // the writer may have given the number to another reference, the old values are not its
+	  const object_handle h = intern(std::string(reinterpret_cast<const char*>(p), length));
+	  if (!body.named || h != body.handle)
+	    body.positioned = body.rotated = false;
+	  body.handle = h;
+	  body.named = true;
+	  p += length;
+	}
+	for (int i = 0; i < 3; i++)
+	  if (!modbus_get_varint(&p, end, &v[i]))
+	    return false;
+
+	// a difference to values that never came is dropped until the next key
+	int64_t* last = op == MODBUS_OP_TRANSLATION ? body.position : body.rotation;
+	bool& valid = op == MODBUS_OP_TRANSLATION ? body.positioned : body.rotated;
+	if (!key && !valid)
+	  continue;
+	for (int i = 0; i < 3; i++)
+	  last[i] = (key ? 0 : last[i]) + modbus_unzigzag(v[i]);
+	valid = true;
+
+	record.reference = uint32_t(number);
+	record.op = uint16_t(op);
+	if (op == MODBUS_OP_TRANSLATION) {
+	  record.count = 3;
+	  for (int i = 0; i < 3; i++)
+	    record.values[i] = last[i] * quantum;
+	} else {
+	  const int32_t q[3] = {int32_t(last[0]), int32_t(last[1]), int32_t(last[2])};
+	  record.count = 9;
+	  modbus_quaternion_matrix(dropped, q, record.values);
+	}
+	apply(body.handle, record);
+      }
+      return true;
+    }
+
+  private:
+    struct Body {
+      Body() : handle(0), named(false), positioned(false), rotated(false) {}
+      object_handle handle;
+      bool named, positioned, rotated;
+      int64_t position[3];
+      int64_t rotation[3];		// the quaternion components but the dropped one
+    };
+
+    std::vector<Body> bodies;		// by reference number
+  };
+
+}
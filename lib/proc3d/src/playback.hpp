@@ -0,0 +1,168 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "animationContext.hpp"
+
+namespace proc3d {
+
+  /*
+    Full scene state at some point in time: the read position of every
+    track and the latest timeline op of every key (see key_of).
+   */
+  struct Checkpoint {
+    double time;
+    std::vector<TrackPosition> tracks;
+    std::size_t timeline;		// first timeline op after time
+    std::vector<std::size_t> latest;	// timeline indices, ascending
+  };
+
+  /*
+    Plays back a committed AnimationContext. The sink has to accept every
+    TimelineOperation as a static visitor and the track values (see TrackCursor).
+    For seek it also needs restore_setup(), which undoes all timeline ops.
+   */
+  class Playback {
+  public:
+    /* at most that many checkpoints are built, regardless of the interval */
+    static const std::size_t MAX_CHECKPOINTS = 256;
+
+    /* translations and rotations are interpolated at the render time, so sparse samples still play smoothly */
+    Playback(const AnimationContext& c) : context(c), cursor(c.tracks), next(0) {
+      cursor.reset();
+    }
+
+    /* evaluate the tracks of large scenes on pool, NULL evaluates them in the calling thread */
+    void parallel(WorkerPool* pool) {
+      cursor.pool = pool;
+    }
+
+    /* rewind to the start, nothing is copied */
+    void restart() {
+      cursor.reset();
+      next = 0;
+    }
+
+    /* apply all ops up to t, returns true as long as there are ops after t */
+    template <typename Sink>
+    bool advance(const double t, const Sink& sink) {
+      const Timeline& timeline = context.deltaOps;
+      while (next < timeline.committed() && timeline.time(next) <= t)
+	boost::apply_visitor( sink, timeline[next++] );
+
+      const bool pending = cursor.advance(t, sink);
+      return pending || next < timeline.committed();
+    }
+
+    /*
+      Record the scene state every interval seconds, so seek only has to
+      replay the ops since the nearest checkpoint.
+     */
+    void build_checkpoints(double interval) {
+      checkpoints.clear();
+
+      const double start = context.start_time(), end = context.end_time();
+      interval = std::max(interval, (end - start) / MAX_CHECKPOINTS);
+      if (!(interval > 0.0))
+	return;
+
+      TrackCursor sweep(context.tracks);
+      sweep.smooth = false;	// only the positions are needed
+      sweep.reset();
+
+      const Timeline& timeline = context.deltaOps;
+      std::map<op_key, std::size_t> latest;
+      std::size_t op = 0;
+
+      for (std::size_t k = 0; start + k * interval <= end; k++) {
+	const double t = start + k * interval;
+	sweep.advance(t, ignore_values());
+
+	for (; op < timeline.committed() && timeline.time(op) <= t; op++)
+	  latest[key_of(timeline[op])] = op;
+
+	Checkpoint cp;
+	cp.time = t;
+	cp.tracks = sweep.positions();
+	cp.timeline = op;
+	for (std::map<op_key, std::size_t>::const_iterator i = latest.begin(); i != latest.end(); i++)
+	  cp.latest.push_back(i->second);
+	std::sort(cp.latest.begin(), cp.latest.end());
+
+	checkpoints.push_back(cp);
+      }
+    }
+
+    /* jump to t, the sink receives the complete scene state at t */
+    template <typename Sink>
+    void seek(const double t, const Sink& sink) {
+      const Timeline& timeline = context.deltaOps;
+      const Checkpoint* cp = nearest(t);
+
+      /* state that no op before t sets has to be the one of the setup */
+      sink.restore_setup();
+      if (cp) {
+	for (std::vector<std::size_t>::const_iterator i = cp->latest.begin(); i != cp->latest.end(); i++)
+	  boost::apply_visitor( sink, timeline[*i] );
+	next = cp->timeline;
+	cursor.seek(cp->tracks, t, sink);
+      } else {
+	next = 0;
+	cursor.seek(std::vector<TrackPosition>(), t, sink);
+      }
+
+      while (next < timeline.committed() && timeline.time(next) <= t)
+	boost::apply_visitor( sink, timeline[next++] );
+    }
+
+  private:
+    const AnimationContext& context;
+    TrackCursor cursor;
+    std::size_t next;			// next timeline op
+    std::vector<Checkpoint> checkpoints;
+
+    struct ignore_values {
+      void set_translation(const object_handle h, const Channel<3>::value_type& v) const {}
+      void set_rotation(const object_handle h, const Channel<4>::value_type& v) const {}
+      void set_scale(const object_handle h, const Channel<3>::value_type& v) const {}
+      void set_ambient(const object_handle h, const Channel<4>::value_type& v) const {}
+      void set_diffuse(const object_handle h, const Channel<4>::value_type& v) const {}
+      void set_specular(const object_handle h, const Channel<4>::value_type& v) const {}
+    };
+
+    static bool earlier(const double t, const Checkpoint& cp) {
+      return t < cp.time;
+    }
+
+    /* latest checkpoint not after t */
+    const Checkpoint* nearest(const double t) const {
+      const std::size_t n = std::upper_bound(checkpoints.begin(), checkpoints.end(), t, earlier) - checkpoints.begin();
+      return n == 0 ? NULL : &checkpoints[n - 1];
+    }
+  };
+
+}
@@ -22,19 +22,86 @@
 #include "proc3d.hpp"
 #include "operations.hpp"
 #include "animationContext.hpp"
+#include "recording.hpp"
+#include "ring.hpp"
+#include "packed.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
 
 #include <boost/array.hpp>
 #include <boost/assign/list_of.hpp>
 #include <boost/numeric/ublas/matrix.hpp>
+#include <boost/static_assert.hpp>
 
 using namespace boost::assign;
 
 namespace proc3d {
 
+  BOOST_STATIC_ASSERT(OP_TYPES == PROC3D_OP_TYPES);
+  BOOST_STATIC_ASSERT(int(SHAPE_PARAMETERS) == int(PROC3D_SHAPE_PARAMETERS));
+
   static inline AnimationContext* getContext(void* ptr) {
     return (AnimationContext*) ptr;
   }
 
+  /* setup ops are rare, concurrent producers simply take turns */
+  static void setup(void* context, const SetupOperation& op) {
+    AnimationContext* const ctx = getContext(context);
+    if (ctx->ingest) {
+      std::lock_guard<std::mutex> lock(ctx->ingest->setup());
+      ctx->setupOps.push(op);
+    } else {
+      ctx->setupOps.push(op);
+    }
+  }
+
+  /* delta ops go to the shard of the calling thread when ingesting concurrently */
+  template <typename Op>
+  static inline void deliver(void* context, const Op& op) {
+    AnimationContext* const ctx = getContext(context);
+    if (ctx->ingest)
+      ctx->ingest->push(*ctx, op);
+    else
+      ctx->push(op);
+  }
+
+  BOOST_STATIC_ASSERT(int(MODBUS_OP_SHAPE_PARAMETER) == int(PROC3D_OP_SHAPE_PARAMETER) && int(MODBUS_OPS) == int(PROC3D_OP_TYPES));
+
+  /* handles of the by-handle API come from clients, those the registry never gave out are ignored */
+  static inline bool known_handle(void* context, const proc3d_handle handle) {
+    AnimationContext* const ctx = getContext(context);
+    return ctx->ingest ? ctx->ingest->known(ctx->registry, handle) : handle < ctx->registry.size();
+  }
+
+  /* a record of a shared memory ring or of packed transforms as the delta op it stands for */
+  static void apply_record(void* context, const object_handle h, const ModbusRecord& r) {
+    static const int needed[MODBUS_OPS] = {3, 3, 3, 9, 0, 4, 4, 4, 2};	// values by op
+    const double* v = r.values;
+    if (r.op >= MODBUS_OPS || r.count < needed[r.op])
+      return;
+
+    switch (r.op) {
+    case MODBUS_OP_TRANSLATION: proc3d_set_translation_by_handle(context, h, v[0], v[1], v[2], r.t); break;
+    case MODBUS_OP_SCALE: proc3d_set_scale_by_handle(context, h, v[0], v[1], v[2], r.t); break;
+    case MODBUS_OP_ROTATION_EULER: proc3d_set_rotation_euler_by_handle(context, h, v[0], v[1], v[2], r.t); break;
+    case MODBUS_OP_ROTATION_MATRIX:
+      proc3d_set_rotation_matrix_by_handle(context, h, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], r.t);
+      break;
+    case MODBUS_OP_AMBIENT_COLOR: proc3d_set_ambient_color_by_handle(context, h, v[0], v[1], v[2], v[3], r.t); break;
+    case MODBUS_OP_DIFFUSE_COLOR: proc3d_set_diffuse_color_by_handle(context, h, v[0], v[1], v[2], v[3], r.t); break;
+    case MODBUS_OP_SPECULAR_COLOR: proc3d_set_specular_color_by_handle(context, h, v[0], v[1], v[2], v[3], r.t); break;
+    case MODBUS_OP_SHAPE_PARAMETER: proc3d_set_shape_parameter_by_handle(context, h, int(v[0]), v[1], r.t); break;
+    default: break;	// material properties are not sent through rings
+    }
+  }
+
+  void AnimationContext::finish_ring() {
+    if (ring)
+      ring->finish();
+  }
+
   extern "C" {
 
     /* memory management */
@@ -44,62 +111,101 @@ namespace proc3d {
     }
 
     void proc3d_animation_context_free(void* context) {
+      getContext(context)->ring.reset();
       delete getContext(context);
     }
 
+    /* names and handles */
+
+    proc3d_handle proc3d_get_handle(void* context, const char* name) {
+      AnimationContext* const ctx = getContext(context);
+      if (ctx->ingest)
+	return ctx->ingest->handle(ctx->registry, name);
+      return ctx->registry.intern(name);
+    }
+
     /* setup ops */
 
-    void proc3d_load_object(void* context, const char* name, const char* filename, const double x, const double y, const double z) {
+    proc3d_handle proc3d_load_object(void* context, const char* name, const char* filename, const double x, const double y, const double z) {
       boost::array<double, 3> arr = {x,y,z};
-      getContext(context)->setupOps.push(LoadObject(name, filename, arr));
+      setup(context, LoadObject(name, filename, arr));
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_group(void* context, const char* name) {
-      getContext(context)->setupOps.push(CreateGroup(name));
+    proc3d_handle proc3d_create_group(void* context, const char* name) {
+      setup(context, CreateGroup(name));
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_material(void* context, const char* name, const double r, const double g, const double b, const double a) {
-      getContext(context)->setupOps.push(CreateMaterial(name));
+    proc3d_handle proc3d_create_material(void* context, const char* name, const double r, const double g, const double b, const double a) {
+      setup(context, CreateMaterial(name));
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_sphere(void* context, const char* name, const double radius) {
-      getContext(context)->setupOps.push(CreateSphere(name, radius));
+    proc3d_handle proc3d_create_sphere(void* context, const char* name, const double radius) {
+      setup(context, CreateSphere(name, radius));
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_box(void* context, const char* name,
+    proc3d_handle proc3d_create_box(void* context, const char* name,
          const double x, const double y, const double z,
          const double width, const double length, const double height) {
       boost::array<double, 3> arr = {x,y,z};
-      getContext(context)->setupOps.push(CreateBox(name, width, length, height, arr));
+      setup(context, CreateBox(name, width, length, height, arr));
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_plane(void* context, const char* name, const double width, const double length) {
-      getContext(context)->setupOps.push(CreatePlane(name, width, length));
+    proc3d_handle proc3d_create_plane(void* context, const char* name, const double width, const double length) {
+      setup(context, CreatePlane(name, width, length));
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_cylinder(void* context, const char* name, const double x, const double y, const double z, const double height, const double radius) {
+    proc3d_handle proc3d_create_cylinder(void* context, const char* name, const double x, const double y, const double z, const double height, const double radius) {
       boost::array<double, 3> arr = {x,y,z};
       CreateCylinder cylinder = CreateCylinder(name, radius, height, arr);
-      getContext(context)->setupOps.push(cylinder);
+      setup(context, cylinder);
+      return proc3d_get_handle(context, name);
     }
 
-    void proc3d_create_cone(void* context, const char* name, const double x, const double y, const double z, const double height, const double radius) {
+    proc3d_handle proc3d_create_cone(void* context, const char* name, const double x, const double y, const double z, const double height, const double radius) {
       boost::array<double, 3> arr = {x,y,z};
-      getContext(context)->setupOps.push(CreateCone(name, radius, height, arr));
+      setup(context, CreateCone(name, radius, height, arr));
+      return proc3d_get_handle(context, name);
+    }
+
+    proc3d_handle proc3d_create_spring(void* context, const char* name, const double x, const double y, const double z,
+				       const double length, const double diameter, const double wire_diameter, const double windings) {
+      boost::array<double, 3> arr = {x,y,z};
+      setup(context, CreateSpring(name, length, diameter, wire_diameter, windings, arr));
+      return proc3d_get_handle(context, name);
+    }
+
+    proc3d_handle proc3d_create_pipe(void* context, const char* name, const double x, const double y, const double z,
+				     const double length, const double diameter, const double inner_ratio) {
+      boost::array<double, 3> arr = {x,y,z};
+      setup(context, CreatePipe(name, length, diameter, inner_ratio, arr));
+      return proc3d_get_handle(context, name);
+    }
+
+    proc3d_handle proc3d_create_gearwheel(void* context, const char* name, const double x, const double y, const double z,
+					  const double length, const double diameter, const double teeth) {
+      boost::array<double, 3> arr = {x,y,z};
+      setup(context, CreateGearwheel(name, length, diameter, teeth, arr));
+      return proc3d_get_handle(context, name);
     }
 
     void proc3d_add_to_group(void* context, const char* name, const char* target) {
-      getContext(context)->setupOps.push(AddToGroup(name, target));
+      setup(context, AddToGroup(name, target));
     }
 
     void proc3d_apply_material(void* context, const char* name, const char* target) {
-      getContext(context)->setupOps.push(ApplyMaterial(name, target));
+      setup(context, ApplyMaterial(name, target));
     }
 
     /* delta ops */
 
     void proc3d_set_rotation_euler(void* context, const char* name, const double x, const double y, const double z, const double time) {
-      getContext(context)->deltaOps.push(RotateEuler(name, time, x, y, z));
+      proc3d_set_rotation_euler_by_handle(context, proc3d_get_handle(context, name), x, y, z, time);
     }
 
     void proc3d_set_rotation_matrix(void* context, const char* name,
@@ -107,37 +213,272 @@ namespace proc3d {
             const double r21, const double r22, const double r23,
             const double r31, const double r32, const double r33,
             const double time) {
-      boost::numeric::ublas::bounded_matrix<double, 3, 3> m;
-      //TODO: This can probably be rewritten with some fancy boost function, I just can't figure out which one ...
-      m(0,0) = r11; m(0,1) = r12; m(0,2) = r13;
-      m(1,0) = r21; m(1,1) = r22; m(1,2) = r23;
-      m(2,0) = r31; m(2,1) = r32; m(2,2) = r33;
-
-      getContext(context)->deltaOps.push(RotateMatrix(name, time, m));
+      proc3d_set_rotation_matrix_by_handle(context, proc3d_get_handle(context, name),
+					   r11, r12, r13, r21, r22, r23, r31, r32, r33, time);
     }
 
     void proc3d_set_translation(void* context, const char* name, const double x, const double y, const double z, const double time) {
-      getContext(context)->deltaOps.push(Move(name, time,x,y,z));
+      proc3d_set_translation_by_handle(context, proc3d_get_handle(context, name), x, y, z, time);
     }
 
     void proc3d_set_scale(void* context, const char* name, const double x, const double y, const double z, const double time) {
-      getContext(context)->deltaOps.push(Scale(name, time,x,y,z));
+      proc3d_set_scale_by_handle(context, proc3d_get_handle(context, name), x, y, z, time);
     }
 
     void proc3d_set_material_property(void* context, const char* name, const char* property, const double value, const double time) {
-      getContext(context)->deltaOps.push(SetMaterialProperty(name, time, property, value));
+      proc3d_set_material_property_by_handle(context, proc3d_get_handle(context, name), property, value, time);
+    }
+
+    void proc3d_set_shape_parameter(void* context, const char* name, const int parameter, const double value, const double time) {
+      proc3d_set_shape_parameter_by_handle(context, proc3d_get_handle(context, name), parameter, value, time);
     }
 
     void proc3d_set_ambient_color(void* context, const char* name, const double r, const double g, const double b, const double a, const double time) {
-      getContext(context)->deltaOps.push(SetAmbientColor(name, time, r, g, b, a));
+      proc3d_set_ambient_color_by_handle(context, proc3d_get_handle(context, name), r, g, b, a, time);
     }
 
     void proc3d_set_specular_color(void* context, const char* name, const double r, const double g, const double b, const double a, const double time) {
-      getContext(context)->deltaOps.push(SetSpecularColor(name, time, r, g, b, a));
+      proc3d_set_specular_color_by_handle(context, proc3d_get_handle(context, name), r, g, b, a, time);
     }
 
     void proc3d_set_diffuse_color(void* context, const char* name, const double r, const double g, const double b, const double a, const double time) {
-      getContext(context)->deltaOps.push(SetDiffuseColor(name, time, r, g, b, a));
+      proc3d_set_diffuse_color_by_handle(context, proc3d_get_handle(context, name), r, g, b, a, time);
+    }
+
+    /* delta ops by handle */
+
+    void proc3d_set_rotation_euler_by_handle(void* context, const proc3d_handle handle, const double x, const double y, const double z, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      deliver(context, RotateEuler(handle, time, x, y, z));
+    }
+
+    void proc3d_set_rotation_matrix_by_handle(void* context, const proc3d_handle handle,
+            const double r11, const double r12, const double r13,
+            const double r21, const double r22, const double r23,
+            const double r31, const double r32, const double r33,
+            const double time) {
+      if (!known_handle(context, handle))
+	return;
+      boost::numeric::ublas::bounded_matrix<double, 3, 3> m;
+      //TODO: This can probably be rewritten with some fancy boost function, I just can't figure out which one ...
+      m(0,0) = r11; m(0,1) = r12; m(0,2) = r13;
+      m(1,0) = r21; m(1,1) = r22; m(1,2) = r23;
+      m(2,0) = r31; m(2,1) = r32; m(2,2) = r33;
+
+      deliver(context, RotateMatrix(handle, time, m));
+    }
+
+    void proc3d_set_translation_by_handle(void* context, const proc3d_handle handle, const double x, const double y, const double z, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      deliver(context, Move(handle, time,x,y,z));
+    }
+
+    void proc3d_set_scale_by_handle(void* context, const proc3d_handle handle, const double x, const double y, const double z, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      deliver(context, Scale(handle, time,x,y,z));
+    }
+
+    void proc3d_set_material_property_by_handle(void* context, const proc3d_handle handle, const char* property, const double value, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      AnimationContext* const ctx = getContext(context);
+      const object_handle p = ctx->ingest ? ctx->ingest->property(ctx->properties, property) : ctx->properties.intern(property);
+      deliver(context, SetMaterialProperty(handle, time, p, value));
+    }
+
+    void proc3d_set_shape_parameter_by_handle(void* context, const proc3d_handle handle, const int parameter, const double value, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      if (parameter < 0 || parameter >= PROC3D_SHAPE_PARAMETERS)
+	return;
+      deliver(context, SetShapeParameter(handle, time, parameter, value));
+    }
+
+    void proc3d_set_ambient_color_by_handle(void* context, const proc3d_handle handle, const double r, const double g, const double b, const double a, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      deliver(context, SetAmbientColor(handle, time, r, g, b, a));
+    }
+
+    void proc3d_set_specular_color_by_handle(void* context, const proc3d_handle handle, const double r, const double g, const double b, const double a, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      deliver(context, SetSpecularColor(handle, time, r, g, b, a));
+    }
+
+    void proc3d_set_diffuse_color_by_handle(void* context, const proc3d_handle handle, const double r, const double g, const double b, const double a, const double time) {
+      if (!known_handle(context, handle))
+	return;
+      deliver(context, SetDiffuseColor(handle, time, r, g, b, a));
+    }
+
+    /* batched delta ops */
+
+    void proc3d_set_transforms(void* context, const double time, const int n, const char** names,
+			       const double* positions, const double* rotations) {
+      if (n <= 0)
+	return;
+
+      AnimationContext* const ctx = getContext(context);
+      std::vector<proc3d_handle>& handles = ctx->ingest ? ctx->ingest->shard().batch : ctx->batch;
+      handles.resize(n);
+      for (int i = 0; i < n; i++)
+	handles[i] = proc3d_get_handle(context, names[i]);
+
+      proc3d_set_transforms_by_handle(context, time, n, handles.data(), positions, rotations);
+    }
+
+    void proc3d_set_transforms_by_handle(void* context, const double time, const int n, const proc3d_handle* handles,
+					 const double* positions, const double* rotations) {
+      if (n <= 0)
+	return;
+
+      AnimationContext* const ctx = getContext(context);
+      bool known = true;
+      for (int i = 0; known && i < n; i++)
+	known = known_handle(context, handles[i]);
+
+      if (!ctx->ingest && known) {
+	ctx->push_transforms(time, n, handles, positions, rotations);
+	return;
+      }
+
+      // one by one, without the unknown handles
+      boost::numeric::ublas::bounded_matrix<double, 3, 3> m;
+      for (int i = 0; i < n; i++) {
+	if (!known && !known_handle(context, handles[i]))
+	  continue;
+	if (positions)
+	  deliver(context, Move(handles[i], time, positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]));
+	if (rotations) {
+	  std::copy(rotations + 9 * i, rotations + 9 * (i + 1), m.data().begin());
+	  deliver(context, RotateMatrix(handles[i], time, m));
+	}
+      }
+    }
+
+    /* keyframe decimation */
+
+    void proc3d_set_decimation(void* context, const double position_tolerance, const double angle_tolerance) {
+      Tolerance& tolerance = getContext(context)->decimator.tolerance;
+      tolerance.position = position_tolerance;
+      tolerance.angle = angle_tolerance;
+    }
+
+    /* concurrent ingestion */
+
+    void proc3d_set_concurrent(void* context) {
+      AnimationContext* const ctx = getContext(context);
+      if (!ctx->ingest)
+	ctx->ingest.reset(new Ingest());
+    }
+
+    /* shared memory */
+
+    int proc3d_attach_ring(void* context, const char* path) {
+      AnimationContext* const ctx = getContext(context);
+      boost::shared_ptr<RingReader> reader(new RingReader(path));
+      if (!reader->ok())
+	return -1;
+
+      /* the reader is one more producer */
+      proc3d_set_concurrent(context);
+      ctx->ring = reader;
+      reader->start(std::bind(&proc3d_get_handle, context, std::bind(&std::string::c_str, std::placeholders::_1)),
+		    std::bind(&apply_record, context, std::placeholders::_1, std::placeholders::_2));
+      return 0;
+    }
+
+    /* packed transforms */
+
+    int proc3d_apply_packed(void* context, const char* sender, const int stream, const double time, const double quantum,
+			    const unsigned char* data, const int length) {
+      AnimationContext* const ctx = getContext(context);
+      boost::shared_ptr<PackedReader>& reader = ctx->packed[std::make_pair(std::string(sender ? sender : ""), stream)];
+      if (!reader)
+	reader.reset(new PackedReader());
+      return reader->read(data, data + length, time, quantum,
+			  std::bind(&proc3d_get_handle, context, std::bind(&std::string::c_str, std::placeholders::_1)),
+			  std::bind(&apply_record, context, std::placeholders::_1, std::placeholders::_2)) ? 0 : -1;
+    }
+
+    /* statistics */
+
+    void proc3d_context_stats(void* context, proc3d_stats* stats) {
+      AnimationContext* const ctx = getContext(context);
+      std::unique_lock<std::mutex> lock;
+      if (ctx->ingest)
+	lock = std::unique_lock<std::mutex>(ctx->ingest->merge_lock());
+
+      const Statistics& s = ctx->stats;
+      for (int i = 0; i < PROC3D_OP_TYPES; i++)
+	stats->delta_ops[i] = s.pushed(i);
+      stats->total_delta_ops = s.pushed();
+      stats->objects = ctx->registry.size();
+      stats->setup_ops = ctx->setupOps.size();
+      stats->keyframes = ctx->tracks.keyframes();
+      stats->timeline_ops = ctx->deltaOps.size();
+      stats->bytes = ctx->memory();
+      stats->peak_bytes = std::max<unsigned long long>(s.peak_bytes(), stats->bytes);
+      stats->ops_per_second = s.recent_rate();
+      stats->average_ops_per_second = s.average_rate();
+    }
+
+    unsigned long long proc3d_object_ops(void* context, const proc3d_handle handle) {
+      AnimationContext* const ctx = getContext(context);
+      std::unique_lock<std::mutex> lock;
+      if (ctx->ingest)
+	lock = std::unique_lock<std::mutex>(ctx->ingest->merge_lock());
+      return ctx->stats.pushed_to(handle);
+    }
+
+    int proc3d_hottest_objects(void* context, const int n, proc3d_handle* handles, unsigned long long* counts) {
+      AnimationContext* const ctx = getContext(context);
+      std::unique_lock<std::mutex> lock;
+      if (ctx->ingest)
+	lock = std::unique_lock<std::mutex>(ctx->ingest->merge_lock());
+
+      const std::vector<object_handle> hot = ctx->stats.hottest(std::max(n, 0));
+      for (std::size_t i = 0; i < hot.size(); i++) {
+	handles[i] = hot[i];
+	if (counts)
+	  counts[i] = ctx->stats.pushed_to(hot[i]);
+      }
+      return hot.size();
+    }
+
+    /* retention */
+
+    void proc3d_set_retention(void* context, const double seconds) {
+      getContext(context)->retention = seconds;
+    }
+
+    /* recordings */
+
+    int proc3d_save_recording(void* context, const char* filename) {
+      AnimationContext* const ctx = getContext(context);
+      if (ctx->spill)
+	return ctx->finish_spill() ? 0 : -1;
+
+      ctx->commit();
+      return save_recording(*ctx, filename) ? 0 : -1;
+    }
+
+    int proc3d_spill_to(void* context, const char* filename, const double budget_mb) {
+      AnimationContext* const ctx = getContext(context);
+      if (ctx->spill)
+	return -1;
+
+      ctx->spill.reset(new SpillWriter(filename));
+      if (!ctx->spill->ok()) {
+	ctx->spill.reset();
+	return -1;
+      }
+      ctx->budget = std::max(1.0, budget_mb * 1024.0 * 1024.0);
+      return 0;
     }
 
     /* signals */
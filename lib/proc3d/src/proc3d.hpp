@@ -33,30 +33,60 @@ extern "C" {
 
   void proc3d_animation_context_free(void* pAnimationContext);
 
-  /* setup ops */
+  /* names and handles */
 
-  void proc3d_load_object(void* context, const char* name, const char* filename, const double x, const double y, const double z);
+  typedef proc3d::object_handle proc3d_handle;
+
+  /* returns the handle of an object or material name, interning it if necessary */
+  proc3d_handle proc3d_get_handle(void* context, const char* name);
+
+  /* setup ops, every creation returns the handle of the new object */
+
+  proc3d_handle proc3d_load_object(void* context, const char* name, const char* filename, const double x, const double y, const double z);
 	
-  void proc3d_create_group(void* context, const char* name);
+  proc3d_handle proc3d_create_group(void* context, const char* name);
 
-  void proc3d_create_material(void* context, const char* name, const double r, const double g, const double b, const double a);
+  proc3d_handle proc3d_create_material(void* context, const char* name, const double r, const double g, const double b, const double a);
 
-  void proc3d_create_sphere(void* context, const char* name, const double radius);
+  proc3d_handle proc3d_create_sphere(void* context, const char* name, const double radius);
 
-  void proc3d_create_box(void* context, const char* name, 
+  proc3d_handle proc3d_create_box(void* context, const char* name, 
 			 const double tx, const double ty, const double tz,
 			 const double width, const double length, const double height);
 
-  void proc3d_create_plane(void* context, const char* name, const double width, const double length);
+  proc3d_handle proc3d_create_plane(void* context, const char* name, const double width, const double length);
 
-  void proc3d_create_cylinder(void* context, const char* name, 
+  proc3d_handle proc3d_create_cylinder(void* context, const char* name, 
 			      const double tx, const double ty, const double tz, 
 			      const double height, const double radius);
 
-  void proc3d_create_cone(void* context, const char* name, 
+  proc3d_handle proc3d_create_cone(void* context, const char* name, 
 			  const double tx, const double ty, const double tz, 
 			  const double height, const double radius);
 
+  /* parametric shapes, their parameters can be changed later (see proc3d_set_shape_parameter).
+     The parameters are those of the Modelica shapes, diameters instead of radii. */
+
+  enum proc3d_shape_parameter {
+    PROC3D_SHAPE_LENGTH,		/* order of proc3d::ShapeParameter */
+    PROC3D_SHAPE_WIDTH,
+    PROC3D_SHAPE_HEIGHT,
+    PROC3D_SHAPE_EXTRA,
+    PROC3D_SHAPE_PARAMETERS
+  };
+
+  proc3d_handle proc3d_create_spring(void* context, const char* name,
+				     const double tx, const double ty, const double tz,
+				     const double length, const double diameter, const double wire_diameter, const double windings);
+
+  proc3d_handle proc3d_create_pipe(void* context, const char* name,
+				   const double tx, const double ty, const double tz,
+				   const double length, const double diameter, const double inner_ratio);
+
+  proc3d_handle proc3d_create_gearwheel(void* context, const char* name,
+					const double tx, const double ty, const double tz,
+					const double length, const double diameter, const double teeth);
+
   void proc3d_add_to_group(void* context, const char* name, const char* target);
 
   void proc3d_apply_material(void* context, const char* name, const char* target);
@@ -77,6 +107,8 @@ extern "C" {
 
   void proc3d_set_material_property(void* context, const char* name, const char* property, const double value, const double time);
 
+  void proc3d_set_shape_parameter(void* context, const char* name, const int parameter, const double value, const double time);
+
   /* coloring */
   void proc3d_set_ambient_color(void* context, const char* name, const double r, const double g, const double b, const double a, const double time);
 
@@ -84,6 +116,118 @@ extern "C" {
 
   void proc3d_set_diffuse_color(void* context, const char* name, const double r, const double g, const double b, const double a, const double time);
 
+  /* delta ops by handle, handles proc3d_get_handle did not return are ignored */
+
+  void proc3d_set_rotation_euler_by_handle(void* context, const proc3d_handle handle, const double x, const double y, const double z, const double time);
+
+  void proc3d_set_rotation_matrix_by_handle(void* context, const proc3d_handle handle, 
+					    const double r11, const double r12, const double r13, 
+					    const double r21, const double r22, const double r23, 
+					    const double r31, const double r32, const double r33, 
+					    const double time);
+
+  void proc3d_set_translation_by_handle(void* context, const proc3d_handle handle, const double x, const double y, const double z, const double time);
+
+  void proc3d_set_scale_by_handle(void* context, const proc3d_handle handle, const double x, const double y, const double z, const double time);
+
+  void proc3d_set_material_property_by_handle(void* context, const proc3d_handle handle, const char* property, const double value, const double time);
+
+  void proc3d_set_shape_parameter_by_handle(void* context, const proc3d_handle handle, const int parameter, const double value, const double time);
+
+  void proc3d_set_ambient_color_by_handle(void* context, const proc3d_handle handle, const double r, const double g, const double b, const double a, const double time);
+
+  void proc3d_set_specular_color_by_handle(void* context, const proc3d_handle handle, const double r, const double g, const double b, const double a, const double time);
+
+  void proc3d_set_diffuse_color_by_handle(void* context, const proc3d_handle handle, const double r, const double g, const double b, const double a, const double time);
+
+  /* batched delta ops: n objects at one time stamp, positions are given as 3 and
+     rotations as 9 (row major) consecutive doubles per object, either may be NULL.
+     n <= 0 does nothing */
+
+  void proc3d_set_transforms(void* context, const double time, const int n, const char** names,
+			     const double* positions, const double* rotations);
+
+  void proc3d_set_transforms_by_handle(void* context, const double time, const int n, const proc3d_handle* handles,
+				       const double* positions, const double* rotations);
+
+  /* keyframe decimation: drop translation and rotation keys that interpolation
+     reconstructs within the given distance and angle (rad), zero disables */
+
+  void proc3d_set_decimation(void* context, const double position_tolerance, const double angle_tolerance);
+
+  /* concurrent ingestion: accept delta ops from several threads at once, each
+     thread buffers its ops and they are merged by time. Call before the
+     producer threads start. */
+
+  void proc3d_set_concurrent(void* context);
+
+  /* shared memory: read the delta ops of a local simulation from the ring at path
+     (see modbus_wire.h) in the background, returns 0 on success. Implies
+     proc3d_set_concurrent, a context reads one ring at a time. */
+
+  int proc3d_attach_ring(void* context, const char* path);
+
+  /* packed transforms: apply the "packed" bytes of a frame at time (see modbus_wire.h),
+     positions are multiples of quantum. The bytes are relative to the earlier frames of
+     the same sender (its bus name) and stream. Returns -1 for bytes that end within a
+     record or hold a bad one. */
+
+  int proc3d_apply_packed(void* context, const char* sender, const int stream, const double time, const double quantum,
+			  const unsigned char* data, const int length);
+
+  /* statistics: counters of a context, cheap enough to be always on. The op
+     rates and the peak memory are sampled every few thousand ops. */
+
+  enum proc3d_op_type {
+    PROC3D_OP_TRANSLATION,		/* order of proc3d::AnimOperation */
+    PROC3D_OP_SCALE,
+    PROC3D_OP_ROTATION_EULER,
+    PROC3D_OP_ROTATION_MATRIX,
+    PROC3D_OP_MATERIAL_PROPERTY,
+    PROC3D_OP_AMBIENT_COLOR,
+    PROC3D_OP_DIFFUSE_COLOR,
+    PROC3D_OP_SPECULAR_COLOR,
+    PROC3D_OP_SHAPE_PARAMETER,
+    PROC3D_OP_TYPES
+  };
+
+  typedef struct {
+    unsigned long long delta_ops[PROC3D_OP_TYPES];	/* pushed so far, by type */
+    unsigned long long total_delta_ops;
+    unsigned long long objects;		/* interned names */
+    unsigned long long setup_ops;		/* held */
+    unsigned long long keyframes;		/* held in tracks, after decimation and retention */
+    unsigned long long timeline_ops;	/* held */
+    unsigned long long bytes;		/* held by keyframes and timeline ops */
+    unsigned long long peak_bytes;
+    double ops_per_second;		/* over the last sample interval */
+    double average_ops_per_second;
+  } proc3d_stats;
+
+  void proc3d_context_stats(void* context, proc3d_stats* stats);
+
+  /* delta ops pushed to one object or material */
+  unsigned long long proc3d_object_ops(void* context, const proc3d_handle handle);
+
+  /* fills up to n handles and op counts of the busiest objects, most first,
+     returns the number filled in. counts may be NULL. */
+  int proc3d_hottest_objects(void* context, const int n, proc3d_handle* handles, unsigned long long* counts);
+
+  /* retention: only keep the animation of the last seconds (plus the state of
+     every object before), zero keeps everything */
+
+  void proc3d_set_retention(void* context, const double seconds);
+
+  /* recordings: write everything pushed so far to a file the viewer can replay,
+     returns 0 on success. A spilling context completes its spill file instead. */
+
+  int proc3d_save_recording(void* context, const char* filename);
+
+  /* stream to a recording: keep only about budget_mb megabytes of keys in memory
+     and write the older ones to filename in the background, returns 0 on success */
+
+  int proc3d_spill_to(void* context, const char* filename, const double budget_mb);
+
   /* signals */
 
   void proc3d_send_signal(void* context, const int signal);
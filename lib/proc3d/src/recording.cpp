@@ -0,0 +1,798 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#include "recording.hpp"
+
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <utility>
+
+namespace proc3d {
+
+  namespace {
+
+    class Writer {
+    public:
+      Writer(std::ofstream& o) : out(o) {}
+
+      template <typename T>
+      void put(const T& v) {
+	out.write((const char*) &v, sizeof(T));
+      }
+
+      void put_string(const boost::string_ref s) {
+	put<uint32_t>(s.size());
+	out.write(s.data(), s.size());
+      }
+
+      /* elements [begin, end) of v */
+      template <typename T>
+      void put_range(const std::vector<T>& v, const std::size_t begin, const std::size_t end) {
+	if (end > begin)
+	  out.write((const char*) &v[begin], (end - begin) * sizeof(T));
+      }
+
+      uint64_t position() {
+	return out.tellp();
+      }
+
+    private:
+      std::ofstream& out;
+    };
+
+    /* bounds checked reads, a failed read yields zeros and clears ok */
+    class Reader {
+    public:
+      Reader(const char* begin, const char* end) : ok(true), p(begin), end(end) {}
+
+      bool ok;
+
+      template <typename T>
+      T get() {
+	T v = T();
+	get_array(&v, 1);
+	return v;
+      }
+
+      template <typename T>
+      void get_array(T* v, const std::size_t n) {
+	if (!ok || n > std::size_t(end - p) / sizeof(T)) {
+	  ok = false;
+	  return;
+	}
+	memcpy(v, p, n * sizeof(T));
+	p += n * sizeof(T);
+      }
+
+      std::string get_string() {
+	const uint32_t n = get<uint32_t>();
+	if (!ok || n > std::size_t(end - p)) {
+	  ok = false;
+	  return std::string();
+	}
+	const std::string s(p, n);
+	p += n;
+	return s;
+      }
+
+      std::size_t remaining() const {
+	return end - p;
+      }
+
+      /* pointer to the next n bytes, NULL if there are less */
+      const char* skip(const std::size_t n) {
+	if (!ok || n > std::size_t(end - p)) {
+	  ok = false;
+	  return NULL;
+	}
+	const char* const q = p;
+	p += n;
+	return q;
+      }
+
+      boost::array<double, 3> get_vec3() {
+	boost::array<double, 3> v;
+	get_array(v.data(), 3);
+	return v;
+      }
+
+    private:
+      const char* p;
+      const char* end;
+    };
+
+    /* setup ops are tagged with their index in SetupOperation, so new ops must be appended there */
+    struct setup_writer : boost::static_visitor<> {
+      setup_writer(Writer& w) : w(w) {}
+      Writer& w;
+
+      void operator()(const CreateGroup& op) const { w.put_string(op.name); }
+      void operator()(const CreateSphere& op) const { w.put_string(op.name); w.put(op.radius); }
+      void operator()(const CreateBox& op) const {
+	w.put_string(op.name); w.put(op.width); w.put(op.length); w.put(op.height); w.put(op.at);
+      }
+      void operator()(const CreateCylinder& op) const {
+	w.put_string(op.name); w.put(op.radius); w.put(op.height); w.put(op.at);
+      }
+      void operator()(const CreateCone& op) const {
+	w.put_string(op.name); w.put(op.radius); w.put(op.height); w.put(op.at);
+      }
+      void operator()(const CreatePlane& op) const { w.put_string(op.name); w.put(op.length); w.put(op.width); }
+      void operator()(const LoadObject& op) const { w.put_string(op.name); w.put_string(op.fileName); w.put(op.at); }
+      void operator()(const ObjectLinkOperation& op) const { w.put_string(op.name); w.put_string(op.target); }
+      void operator()(const CreateMaterial& op) const { w.put_string(op.name); }
+      void operator()(const ParametricShapeOperation& op) const { w.put_string(op.name); w.put(op.parameters); w.put(op.at); }
+    };
+
+    static bool read_setup(Reader& r, std::queue<SetupOperation>& setup) {
+      const uint32_t tag = r.get<uint32_t>();
+      const std::string name = r.get_string();
+
+      switch (tag) {
+      case 0: setup.push(CreateGroup(name)); break;
+      case 1: setup.push(CreateSphere(name, r.get<double>())); break;
+      case 2: {
+	const double w = r.get<double>(), l = r.get<double>(), h = r.get<double>();
+	setup.push(CreateBox(name, w, l, h, r.get_vec3()));
+	break;
+      }
+      case 3: {
+	const double radius = r.get<double>(), h = r.get<double>();
+	setup.push(CreateCylinder(name, radius, h, r.get_vec3()));
+	break;
+      }
+      case 4: {
+	const double radius = r.get<double>(), h = r.get<double>();
+	setup.push(CreateCone(name, radius, h, r.get_vec3()));
+	break;
+      }
+      case 5: {
+	const double l = r.get<double>(), w = r.get<double>();
+	setup.push(CreatePlane(name, l, w));
+	break;
+      }
+      case 6: {
+	const std::string file = r.get_string();
+	setup.push(LoadObject(name, file, r.get_vec3()));
+	break;
+      }
+      case 7: setup.push(AddToGroup(name, r.get_string())); break;
+      case 8: setup.push(CreateMaterial(name)); break;
+      case 9: setup.push(ApplyMaterial(name, r.get_string())); break;
+      case 10: case 11: case 12: {
+	boost::array<double, SHAPE_PARAMETERS> p;
+	r.get_array(p.data(), p.size());
+	const boost::array<double, 3> at = r.get_vec3();
+	if (tag == 10)
+	  setup.push(CreateSpring(name, p[SHAPE_LENGTH], p[SHAPE_WIDTH], p[SHAPE_HEIGHT], p[SHAPE_EXTRA], at));
+	else if (tag == 11)
+	  setup.push(CreatePipe(name, p[SHAPE_LENGTH], p[SHAPE_WIDTH], p[SHAPE_EXTRA], at));
+	else
+	  setup.push(CreateGearwheel(name, p[SHAPE_LENGTH], p[SHAPE_WIDTH], p[SHAPE_EXTRA], at));
+	break;
+      }
+      default: return false;
+      }
+      return r.ok;
+    }
+
+    struct timeline_writer : boost::static_visitor<> {
+      timeline_writer(Writer& w) : w(w) {}
+      Writer& w;
+
+      void operator()(const RotateEuler& op) const { w.put(op.x); w.put(op.y); w.put(op.z); }
+      void operator()(const SetMaterialProperty& op) const { w.put<uint32_t>(op.property); w.put(op.value); }
+      void operator()(const SetShapeParameter& op) const { w.put<uint32_t>(op.parameter); w.put(op.value); }
+    };
+
+    static void write_op(Writer& w, const TimelineOperation& op) {
+      w.put<uint32_t>(op.which());
+      w.put<uint32_t>(handle_of(op));
+      w.put(time_of(op));
+      boost::apply_visitor( timeline_writer(w), op );
+    }
+
+    static bool read_op(Reader& r, Timeline& timeline) {
+      const uint32_t tag = r.get<uint32_t>();
+      const object_handle handle = r.get<uint32_t>();
+      const double time = r.get<double>();
+
+      switch (tag) {
+      case 0: {
+	const double x = r.get<double>(), y = r.get<double>(), z = r.get<double>();
+	timeline.push(RotateEuler(handle, time, x, y, z));
+	break;
+      }
+      case 1: {
+	const object_handle property = r.get<uint32_t>();
+	timeline.push(SetMaterialProperty(handle, time, property, r.get<double>()));
+	break;
+      }
+      case 2: {
+	const unsigned int parameter = r.get<uint32_t>();
+	timeline.push(SetShapeParameter(handle, time, parameter, r.get<double>()));
+	break;
+      }
+      default: return false;
+      }
+      return r.ok;
+    }
+
+    /* the keys of [start, end), or [start, end] for the last window, plus one on either side */
+    template <std::size_t N>
+    static void write_channel(Writer& w, const Channel<N>& channel, const double start, const double end, const bool last) {
+      std::size_t first = std::lower_bound(channel.times.begin(), channel.times.end(), start) - channel.times.begin();
+      std::size_t stop = last ? channel.size()
+	: std::lower_bound(channel.times.begin(), channel.times.end(), end) - channel.times.begin();
+      if (first > 0) first--;
+      if (stop < channel.size()) stop++;
+
+      w.put<uint32_t>(stop - first);
+      w.put_range(channel.times, first, stop);
+      w.put_range(channel.values, first, stop);
+    }
+
+    template <std::size_t N>
+    static void read_channel(Reader& r, Channel<N>& channel) {
+      typedef typename Channel<N>::stored_type stored_type;
+
+      // the count of a corrupt window must not size the channel beyond the bytes that are left
+      const uint32_t n = r.get<uint32_t>();
+      if (r.ok && n > r.remaining() / (sizeof(double) + sizeof(stored_type)))
+	r.ok = false;
+      if (!r.ok)
+	return;
+
+      channel.times.resize(n);
+      channel.values.resize(n);
+      if (n > 0) {
+	r.get_array(&channel.times[0], n);
+	r.get_array(&channel.values[0], n);
+      }
+    }
+
+    /* append the first key of the next window's channel that comes after the last one of channel */
+    template <std::size_t N>
+    static void read_next_key(Reader& r, Channel<N>& channel) {
+      typedef typename Channel<N>::stored_type stored_type;
+
+      const uint32_t n = r.get<uint32_t>();
+      const char* const times = r.skip(n * sizeof(double));
+      const char* const values = r.skip(n * sizeof(stored_type));
+      if (!r.ok)
+	return;
+
+      const double last = channel.empty() ? -std::numeric_limits<double>::infinity() : channel.times.back();
+      for (uint32_t i = 0; i < n; i++) {
+	double t;
+	memcpy(&t, times + i * sizeof(double), sizeof(double));
+	if (t > last) {
+	  stored_type v;
+	  memcpy(&v, values + i * sizeof(stored_type), sizeof(stored_type));
+	  channel.times.push_back(t);
+	  channel.values.push_back(v);
+	  return;
+	}
+      }
+    }
+
+    static void write_names(Writer& w, const NameRegistry& registry) {
+      w.put<uint32_t>(registry.size());
+      for (object_handle h = 0; h < registry.size(); h++)
+	w.put_string(registry.name(h));
+    }
+
+    static void read_names(Reader& r, NameRegistry& registry) {
+      const uint32_t n = r.get<uint32_t>();
+      for (uint32_t i = 0; r.ok && i < n; i++)
+	registry.intern(r.get_string());
+    }
+
+    static RecordingHeader make_header(const AnimationContext& context) {
+      RecordingHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+      header.version = RECORDING_VERSION;
+      header.byte_order = RECORDING_BYTE_ORDER;
+      header.scalar_size = sizeof(track_scalar);
+      header.position_tolerance = context.decimator.tolerance.position;
+      header.angle_tolerance = context.decimator.tolerance.angle;
+      header.start_time = context.start_time();
+      header.end_time = context.end_time();
+      return header;
+    }
+
+    /* names and setup ops */
+    static void write_scene(Writer& w, const AnimationContext& context, RecordingHeader& header) {
+      header.names_offset = w.position();
+      write_names(w, context.registry);
+      write_names(w, context.properties);
+
+      header.setup_offset = w.position();
+      std::queue<SetupOperation> setup(context.setupOps);
+      w.put<uint32_t>(setup.size());
+      for (; !setup.empty(); setup.pop()) {
+	w.put<uint32_t>(setup.front().which());
+	boost::apply_visitor( setup_writer(w), setup.front() );
+      }
+    }
+
+    static void write_tracks(Writer& w, const TrackStore& tracks, const double start, const double end, const bool last) {
+      w.put<uint32_t>(tracks.size());
+      for (object_handle h = 0; h < tracks.size(); h++) {
+	const ObjectTracks& obj = tracks[h];
+	write_channel(w, obj.translation, start, end, last);
+	write_channel(w, obj.rotation, start, end, last);
+	write_channel(w, obj.scale, start, end, last);
+	write_channel(w, obj.ambient, start, end, last);
+	write_channel(w, obj.diffuse, start, end, last);
+	write_channel(w, obj.specular, start, end, last);
+      }
+    }
+
+    /* the ops at the indices in before, then those in [begin, stop) */
+    static void write_ops(Writer& w, const Timeline& timeline, const std::vector<std::size_t>& before,
+			  const std::size_t begin, const std::size_t stop) {
+      w.put<uint32_t>(before.size() + (stop - begin));
+      for (std::vector<std::size_t>::const_iterator j = before.begin(); j != before.end(); j++)
+	write_op(w, timeline[*j]);
+      for (std::size_t j = begin; j < stop; j++)
+	write_op(w, timeline[j]);
+    }
+
+    static void write_index(Writer& w, const std::vector<WindowIndex>& index, RecordingHeader& header) {
+      header.index_offset = w.position();
+      header.windows = index.size();
+      w.put_range(index, 0, index.size());
+    }
+
+    /* keys before end go to sealed, the last two of them also stay for the decimator and the next window */
+    template <std::size_t N>
+    static void seal_channel(Channel<N>& live, Channel<N>& sealed, const double end) {
+      const std::size_t n = std::lower_bound(live.times.begin(), live.times.end(), end) - live.times.begin();
+      if (n == 0)
+	return;
+
+      sealed.times.assign(live.times.begin(), live.times.begin() + n);
+      sealed.values.assign(live.values.begin(), live.values.begin() + n);
+      live.drop_before(end, 2);
+    }
+
+    static boost::shared_ptr<SpillChunk> split(AnimationContext& context, const double end) {
+      boost::shared_ptr<SpillChunk> chunk(new SpillChunk());
+      const double until = context.spill->sealed_until();
+      chunk->start = until > -std::numeric_limits<double>::infinity() ? until : context.start_time();
+      chunk->end = end;
+
+      for (object_handle h = 0; h < context.tracks.size(); h++) {
+	ObjectTracks& live = context.tracks[h];
+	ObjectTracks& sealed = chunk->tracks[h];
+	seal_channel(live.translation, sealed.translation, end);
+	seal_channel(live.rotation, sealed.rotation, end);
+	seal_channel(live.scale, sealed.scale, end);
+	seal_channel(live.ambient, sealed.ambient, end);
+	seal_channel(live.diffuse, sealed.diffuse, end);
+	seal_channel(live.specular, sealed.specular, end);
+      }
+      context.deltaOps.split(end, chunk->ops);
+      chunk->ops.commit();
+      return chunk;
+    }
+
+    static bool earlier(const double t, const WindowIndex& w) {
+      return t < w.start;
+    }
+
+  }
+
+  bool save_recording(const AnimationContext& context, const std::string& file) {
+    std::ofstream out(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+      std::cerr << "Cannot write recording: " << file << std::endl;
+      return false;
+    }
+    Writer w(out);
+
+    RecordingHeader header = make_header(context);
+    w.put(header);
+    write_scene(w, context, header);
+
+    /* equally long windows of roughly KEYS_PER_WINDOW keys each */
+    const TrackStore& tracks = context.tracks;
+    const Timeline& timeline = context.deltaOps;
+    const std::size_t keys = tracks.keyframes() + timeline.committed();
+    std::size_t windows = std::max<std::size_t>(1, (keys + KEYS_PER_WINDOW - 1) / KEYS_PER_WINDOW);
+    double duration = (header.end_time - header.start_time) / windows;
+    if (!(duration > 0.0)) {
+      windows = 1;
+      duration = 0.0;
+    }
+
+    std::vector<WindowIndex> index(windows);
+    std::map<op_key, std::size_t> latest;
+    std::size_t op = 0;
+
+    for (std::size_t i = 0; i < windows; i++) {
+      const bool last = i + 1 == windows;
+      WindowIndex& entry = index[i];
+      entry.start = header.start_time + i * duration;
+      entry.end = last ? header.end_time : header.start_time + (i + 1) * duration;
+      entry.offset = w.position();
+
+      write_tracks(w, tracks, entry.start, entry.end, last);
+
+      /* the latest op of every key before the window restores the state at its start */
+      for (; op < timeline.committed() && timeline.time(op) < entry.start; op++)
+	latest[key_of(timeline[op])] = op;
+
+      std::vector<std::size_t> before;
+      for (std::map<op_key, std::size_t>::const_iterator j = latest.begin(); j != latest.end(); j++)
+	before.push_back(j->second);
+      std::sort(before.begin(), before.end());
+
+      std::size_t stop = op;
+      while (stop < timeline.committed() && (last || timeline.time(stop) < entry.end))
+	stop++;
+
+      write_ops(w, timeline, before, op, stop);
+      entry.size = w.position() - entry.offset;
+    }
+
+    write_index(w, index, header);
+    out.seekp(0);
+    w.put(header);
+    out.close();
+
+    if (!out) {
+      std::cerr << "Error writing recording: " << file << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  SpillWriter::SpillWriter(const std::string& file) :
+    path(file), out(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc),
+    until(-std::numeric_limits<double>::infinity()), done(false), stop(false), failed(false) {
+    if (!out) {
+      std::cerr << "Cannot write recording: " << file << std::endl;
+      failed = true;
+      return;
+    }
+
+    /* placeholder, the real header is written by finish() */
+    RecordingHeader header;
+    memset(&header, 0, sizeof(header));
+    Writer(out).put(header);
+
+    worker = std::thread(&SpillWriter::run, this);
+  }
+
+  SpillWriter::~SpillWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    if (worker.joinable())
+      worker.join();
+  }
+
+  void SpillWriter::write(const boost::shared_ptr<SpillChunk>& chunk) {
+    until = chunk->end;
+    if (failed)
+      return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending)
+      changed.wait(lock);
+    pending = chunk;
+    changed.notify_all();
+  }
+
+  void SpillWriter::run() {
+    Writer w(out);
+
+    for (;;) {
+      boost::shared_ptr<SpillChunk> chunk;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!pending && !stop)
+	  changed.wait(lock);
+	if (!pending)
+	  return;
+	chunk = pending;
+      }
+
+      /* sealed chunks hold exactly the keys and ops to write */
+      WindowIndex entry;
+      entry.start = chunk->start;
+      entry.end = chunk->end;
+      entry.offset = w.position();
+      write_tracks(w, chunk->tracks, -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), true);
+      write_ops(w, chunk->ops, std::vector<std::size_t>(), 0, chunk->ops.committed());
+      entry.size = w.position() - entry.offset;
+
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	index.push_back(entry);
+	if (!out)
+	  failed = true;
+	pending.reset();
+      }
+      changed.notify_all();
+    }
+  }
+
+  bool SpillWriter::finish(const AnimationContext& context) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (pending)
+	changed.wait(lock);
+      stop = true;
+    }
+    changed.notify_all();
+    if (worker.joinable())
+      worker.join();
+    done = true;
+
+    if (failed) {
+      std::cerr << "Error writing recording: " << path << std::endl;
+      return false;
+    }
+
+    Writer w(out);
+    RecordingHeader header = make_header(context);
+    if (!index.empty()) {
+      header.start_time = index.front().start;
+      header.end_time = index.back().end;
+    }
+    write_scene(w, context, header);
+    write_index(w, index, header);
+    out.seekp(0);
+    w.put(header);
+    out.close();
+
+    if (!out) {
+      failed = true;
+      std::cerr << "Error writing recording: " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  void AnimationContext::seal() {
+    if (!spill || spill->finished())
+      return;
+
+    /* runs inside push(), possibly while the shards are merged */
+    deltaOps.commit();
+    const double end = std::max(tracks.end_time(), deltaOps.end_time());
+    const boost::shared_ptr<SpillChunk> chunk = split(*this, end);
+
+    /* everything is at the same time stamp, nothing to seal yet */
+    if (chunk->tracks.keyframes() == 0 && chunk->ops.empty())
+      return;
+
+    spill->write(chunk);
+  }
+
+  bool AnimationContext::finish_spill() {
+    if (!spill)
+      return false;
+    if (spill->finished())
+      return spill->ok();
+
+    commit();
+    const double end = std::max(tracks.end_time(), deltaOps.end_time());
+    const boost::shared_ptr<SpillChunk> chunk = split(*this, std::numeric_limits<double>::infinity());
+    chunk->end = std::max(end, chunk->start);
+    if (chunk->tracks.keyframes() > 0 || !chunk->ops.empty())
+      spill->write(chunk);
+
+    return spill->finish(*this);
+  }
+
+  Recording::Recording() : fd(-1), data(NULL), length(0), current(0) {
+    memset(&header, 0, sizeof(header));
+  }
+
+  Recording::~Recording() {
+    close();
+  }
+
+  bool Recording::open(const std::string& file) {
+    close();
+
+#ifdef _WIN32
+    std::cerr << "Recordings are not supported on this platform" << std::endl;
+    return false;
+#else
+    fd = ::open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      std::cerr << "Cannot open recording: " << file << std::endl;
+      close();
+      return false;
+    }
+
+    length = st.st_size;
+    if (length < sizeof(RecordingHeader)) {
+      std::cerr << "Not a recording: " << file << std::endl;
+      close();
+      return false;
+    }
+
+    void* const mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "Cannot map recording: " << file << std::endl;
+      length = 0;
+      close();
+      return false;
+    }
+    data = (const char*) mapped;
+#endif
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0 || header.byte_order != RECORDING_BYTE_ORDER) {
+      std::cerr << "Not a recording: " << file << std::endl;
+      close();
+      return false;
+    }
+    if (header.version != RECORDING_VERSION || header.scalar_size != sizeof(track_scalar)) {
+      std::cerr << "Unsupported recording version " << header.version << " (" << 8 * header.scalar_size
+		<< " bit values): " << file << std::endl;
+      close();
+      return false;
+    }
+
+    Reader names(data + std::min<uint64_t>(header.names_offset, length), data + length);
+    read_names(names, window.registry);
+    read_names(names, window.properties);
+
+    Reader setup(data + std::min<uint64_t>(header.setup_offset, length), data + length);
+    const uint32_t n = setup.get<uint32_t>();
+    for (uint32_t i = 0; setup.ok && i < n; i++)
+      setup.ok = read_setup(setup, window.setupOps);
+
+    Reader windows(data + std::min<uint64_t>(header.index_offset, length), data + length);
+    if (header.windows <= length / sizeof(WindowIndex)) {
+      index.resize(header.windows);
+      if (!index.empty())
+	windows.get_array(&index[0], index.size());
+    } else {
+      windows.ok = false;
+    }
+
+    for (std::vector<WindowIndex>::const_iterator i = index.begin(); windows.ok && i != index.end(); i++)
+      windows.ok = i->offset <= length && i->size <= length - i->offset;
+
+    if (!names.ok || !setup.ok || !windows.ok) {
+      std::cerr << "Corrupt recording: " << file << std::endl;
+      close();
+      return false;
+    }
+
+    window.decimator.tolerance.position = header.position_tolerance;
+    window.decimator.tolerance.angle = header.angle_tolerance;
+    current = index.size();
+    return true;
+  }
+
+  void Recording::close() {
+#ifndef _WIN32
+    if (data)
+      munmap((void*) data, length);
+    if (fd >= 0)
+      ::close(fd);
+#endif
+    fd = -1;
+    data = NULL;
+    length = 0;
+
+    memset(&header, 0, sizeof(header));
+    index.clear();
+    current = 0;
+    window = AnimationContext();
+  }
+
+  bool Recording::contains(const double t) const {
+    return current < index.size() && window_at(t) == current;
+  }
+
+  bool Recording::load(const double t) {
+    if (index.empty())
+      return false;
+
+    const std::size_t w = window_at(t);
+    if (w == current)
+      return false;
+
+    load_window(w);
+    return true;
+  }
+
+  std::size_t Recording::window_at(const double t) const {
+    const std::size_t n = std::upper_bound(index.begin(), index.end(), t, earlier) - index.begin();
+    return n == 0 ? 0 : n - 1;
+  }
+
+  bool Recording::load_window(const std::size_t w) {
+    window.tracks.clear();
+    window.deltaOps.clear();
+    current = w;
+
+    Reader r(data + index[w].offset, data + index[w].offset + index[w].size);
+    const uint32_t objects = r.get<uint32_t>();
+    for (object_handle h = 0; r.ok && h < objects; h++) {
+      ObjectTracks& obj = window.tracks[h];
+      read_channel(r, obj.translation);
+      read_channel(r, obj.rotation);
+      read_channel(r, obj.scale);
+      read_channel(r, obj.ambient);
+      read_channel(r, obj.diffuse);
+      read_channel(r, obj.specular);
+    }
+
+    const uint32_t ops = r.get<uint32_t>();
+    for (uint32_t i = 0; r.ok && i < ops; i++)
+      r.ok = read_op(r, window.deltaOps);
+    window.commit();
+
+    if (!r.ok) {
+      std::cerr << "Corrupt recording window " << w << std::endl;
+      window.tracks.clear();
+      window.deltaOps.clear();
+      return false;
+    }
+
+    if (w + 1 < index.size())
+      load_next_keys(w + 1);
+    return true;
+  }
+
+  /* interpolating up to the end of a window needs the first key after it */
+  void Recording::load_next_keys(const std::size_t w) {
+    Reader r(data + index[w].offset, data + index[w].offset + index[w].size);
+    const uint32_t objects = r.get<uint32_t>();
+    for (object_handle h = 0; r.ok && h < objects && h < window.tracks.size(); h++) {
+      ObjectTracks& obj = window.tracks[h];
+      read_next_key(r, obj.translation);
+      read_next_key(r, obj.rotation);
+      read_next_key(r, obj.scale);
+      read_next_key(r, obj.ambient);
+      read_next_key(r, obj.diffuse);
+      read_next_key(r, obj.specular);
+    }
+  }
+
+}
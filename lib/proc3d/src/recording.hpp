@@ -0,0 +1,182 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "animationContext.hpp"
+
+namespace proc3d {
+
+  /*
+    Binary recording of an AnimationContext (native byte order):
+
+      RecordingHeader
+      names		object names, then material property names
+      setup ops
+      windows		one per time window, see below
+      index		RecordingHeader::windows WindowIndex entries
+
+    A window is self contained: for every channel it holds the last key
+    before the window, all keys inside and the first key after it, and
+    for every object the latest timeline op of each kind before the window,
+    followed by the ops inside. Loading one window is enough to play it.
+    Windows written while streaming (see SpillWriter) lack the key after
+    the window, the reader takes it from the next window instead.
+   */
+
+  static const char RECORDING_MAGIC[8] = {'M', '3', 'D', 'R', 'E', 'C', 0, 0};
+  static const uint32_t RECORDING_VERSION = 1;
+  static const uint32_t RECORDING_BYTE_ORDER = 0x01020304;
+
+  struct RecordingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t scalar_size;		// sizeof(track_scalar) of the writer
+    uint32_t reserved;
+    double position_tolerance;		// decimation of the recorded context
+    double angle_tolerance;
+    double start_time, end_time;
+    uint64_t names_offset;
+    uint64_t setup_offset;
+    uint64_t index_offset;
+    uint64_t windows;
+  };
+
+  struct WindowIndex {
+    double start, end;
+    uint64_t offset, size;
+  };
+
+  /* about that many keys go into one window */
+  static const std::size_t KEYS_PER_WINDOW = 1 << 16;
+
+  /* write a committed context to file, returns false on I/O errors */
+  bool save_recording(const AnimationContext& context, const std::string& file);
+
+  /* the part of a streamed context sealed at once, becomes one window */
+  struct SpillChunk {
+    double start, end;
+    TrackStore tracks;
+    Timeline ops;
+  };
+
+  /*
+    Writes the chunks sealed by AnimationContext::seal() to a recording in a
+    background thread. Only one chunk waits at a time, write() blocks until
+    the previous one is on disk, so a streamed context holds at most about
+    twice its budget.
+   */
+  class SpillWriter {
+  public:
+    SpillWriter(const std::string& file);
+    ~SpillWriter();
+
+    /* false after an I/O error */
+    bool ok() const { return !failed; }
+
+    bool finished() const { return done; }
+
+    const std::string& file() const { return path; }
+
+    /* end of the last sealed chunk, -inf before the first one */
+    double sealed_until() const { return until; }
+
+    void write(const boost::shared_ptr<SpillChunk>& chunk);
+
+    /* wait for the writer and complete the file with the names, setup ops and index of context */
+    bool finish(const AnimationContext& context);
+
+  private:
+    SpillWriter(const SpillWriter&);
+    SpillWriter& operator=(const SpillWriter&);
+
+    const std::string path;
+    std::ofstream out;
+    std::vector<WindowIndex> index;
+    double until;
+    bool done, stop;
+    std::atomic<bool> failed;		// set by the background thread, read by write() and ok()
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    boost::shared_ptr<SpillChunk> pending;
+    std::thread worker;
+
+    void run();
+  };
+
+  /*
+    Read only, memory mapped view of a recording. Opening only reads the
+    names, setup ops and index, time windows are decoded on demand into
+    context(), which stays the same object for the lifetime of the recording.
+   */
+  class Recording {
+  public:
+    Recording();
+    ~Recording();
+
+    bool open(const std::string& file);
+    void close();
+
+    /* the setup ops and the currently loaded window */
+    const AnimationContext& context() const { return window; }
+
+    double start_time() const { return header.start_time; }
+    double end_time() const { return header.end_time; }
+
+    /* true if the loaded window covers t */
+    bool contains(const double t) const;
+
+    /* make sure the window covering t is loaded, returns true if it had to be loaded */
+    bool load(const double t);
+
+  private:
+    Recording(const Recording&);
+    Recording& operator=(const Recording&);
+
+    int fd;
+    const char* data;
+    std::size_t length;
+
+    RecordingHeader header;
+    std::vector<WindowIndex> index;
+    std::size_t current;		// loaded window, index.size() if none
+    AnimationContext window;
+
+    std::size_t window_at(const double t) const;
+    bool load_window(const std::size_t w);
+    void load_next_keys(const std::size_t w);
+  };
+
+}
@@ -0,0 +1,175 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "operations.hpp"
+#include "modbus_wire.h"
+
+namespace proc3d {
+
+  /*
+    Reader of a shared memory ring written by a simulation (see
+    modbus_wire.h). A background thread hands every record to apply,
+    straight out of the segment, together with the handle intern gave
+    its reference. The thread ends once the writer closed the ring and
+    everything was read, or when the reader is destroyed.
+   */
+  class RingReader {
+  public:
+    typedef std::function<object_handle (const std::string&)> Intern;
+    typedef std::function<void (const object_handle, const ModbusRecord&)> Apply;
+
+    /* an idle reader yields that many times before it sleeps between polls */
+    static const int SPINS = 1000;
+
+    /* records beyond these bounds are dropped, the writer is another process */
+    static const uint32_t MAX_REFERENCES = 1 << 20;
+    static const std::size_t MAX_NAME = 4096;
+
+    /* how long finish() waits on an empty ring for a writer that never closes it */
+    static const int FINISH_WAIT_MS = 1000;
+
+    RingReader(const char* path) : ring(NULL), bytes(0), stop(false), finishing(false) {
+#ifndef _WIN32
+      const int fd = shm_open(path, O_RDWR, 0);
+      if (fd < 0)
+	return;
+
+      /* map the header first, it tells the size of the segment, which has to match this reader's layout */
+      struct stat st;
+      const bool sized = fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(ModbusRing);
+      void* mem = sized ? mmap(NULL, sizeof(ModbusRing), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+      if (mem != MAP_FAILED) {
+	const ModbusRing* header = static_cast<const ModbusRing*>(mem);
+	const bool valid = header->magic == MODBUS_RING_MAGIC && header->version == MODBUS_RING_VERSION &&
+	  header->record_size == sizeof(ModbusRecord) && header->capacity > 0 &&
+	  MODBUS_RING_BYTES(header->capacity) <= std::size_t(st.st_size);
+	const std::size_t size = valid ? MODBUS_RING_BYTES(header->capacity) : 0;
+	munmap(mem, sizeof(ModbusRing));
+
+	mem = valid ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (mem != MAP_FAILED) {
+	  ring = static_cast<ModbusRing*>(mem);
+	  bytes = size;
+	}
+      }
+      close(fd);
+#endif
+    }
+
+    ~RingReader() {
+      stop = true;
+      if (worker.joinable())
+	worker.join();
+#ifndef _WIN32
+      if (ring)
+	munmap(ring, bytes);
+#endif
+    }
+
+    bool ok() const { return ring != NULL; }
+
+    void start(const Intern& intern, const Apply& apply) {
+      worker = std::thread(&RingReader::run, this, intern, apply);
+    }
+
+    /*
+      Read until the writer closed the ring and everything was applied, then
+      end the thread. A writer that ended without closing is given
+      FINISH_WAIT_MS after the last record. Nothing is pushed afterwards.
+     */
+    void finish() {
+      finishing = true;
+      if (worker.joinable())
+	worker.join();
+    }
+
+  private:
+    ModbusRing* ring;
+    std::size_t bytes;
+    std::atomic<bool> stop, finishing;
+    std::thread worker;
+
+    void run(const Intern intern, const Apply apply) {
+      std::vector<object_handle> handles;	// by reference number
+      std::string name;			// a name spanning several records
+      const object_handle none = ~object_handle(0);	// a reference without a name record
+      const std::size_t chunk = sizeof(ModbusRecord::values);
+      uint64_t tail = modbus_ring_load(&ring->tail);
+      int idle = 0;
+      std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+      while (!stop) {
+	const uint64_t head = modbus_ring_load(&ring->head);
+	if (tail == head) {
+	  if (modbus_ring_load(&ring->closed) && modbus_ring_load(&ring->head) == tail)
+	    return;
+	  if (finishing && std::chrono::steady_clock::now() - last > std::chrono::milliseconds(FINISH_WAIT_MS))
+	    return;
+	  if (++idle < SPINS)
+	    std::this_thread::yield();
+	  else
+	    std::this_thread::sleep_for(std::chrono::microseconds(200));
+	  continue;
+	}
+	idle = 0;
+	last = std::chrono::steady_clock::now();
+
+	for (; tail != head; tail++) {
+	  const ModbusRecord& record = ring->records[tail % ring->capacity];
+	  if (record.op == MODBUS_OP_NAME) {
+	    if (record.count > chunk || record.reference >= MAX_REFERENCES || name.size() + record.count > MAX_NAME) {
+	      name.clear();
+	      continue;
+	    }
+	    name.append(reinterpret_cast<const char*>(record.values), record.count);
+	    if (record.count < chunk) {
+	      if (handles.size() <= record.reference)
+		handles.resize(record.reference + 1, none);
+	      handles[record.reference] = intern(name);
+	      name.clear();
+	    }
+	  } else if (record.count <= MODBUS_RECORD_VALUES && record.reference < handles.size() &&
+		     handles[record.reference] != none) {
+	    apply(handles[record.reference], record);
+	  }
+	}
+	modbus_ring_store(&ring->tail, tail);
+      }
+    }
+  };
+
+}
@@ -0,0 +1,125 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/array.hpp>
+
+namespace proc3d {
+
+  /* quaternions are stored as x, y, z, w like osg::Quat */
+  typedef boost::array<double, 4> quaternion;
+
+  /* row major 3x3 matrix */
+  typedef boost::array<double, 9> rotation_matrix;
+
+  /* same conversion as osg::Matrixd::getRotate() for a matrix with the given rows */
+  static inline quaternion quat_from_matrix(const rotation_matrix& m) {
+    double tq[4];
+    tq[0] = 1 + m[0] + m[4] + m[8];
+    tq[1] = 1 + m[0] - m[4] - m[8];
+    tq[2] = 1 - m[0] + m[4] - m[8];
+    tq[3] = 1 - m[0] - m[4] + m[8];
+
+    int j = 0;
+    for (int i = 1; i < 4; i++)
+      j = (tq[i] > tq[j]) ? i : j;
+
+    quaternion q;
+    double& x = q[0]; double& y = q[1]; double& z = q[2]; double& w = q[3];
+    switch (j) {
+    case 0: w = tq[0]; x = m[5] - m[7]; y = m[6] - m[2]; z = m[1] - m[3]; break;
+    case 1: w = m[5] - m[7]; x = tq[1]; y = m[1] + m[3]; z = m[6] + m[2]; break;
+    case 2: w = m[6] - m[2]; x = m[1] + m[3]; y = tq[2]; z = m[5] + m[7]; break;
+    default: w = m[1] - m[3]; x = m[6] + m[2]; y = m[5] + m[7]; z = tq[3]; break;
+    }
+
+    const double s = std::sqrt(0.25 / tq[j]);
+    for (int i = 0; i < 4; i++)
+      q[i] *= s;
+    return q;
+  }
+
+  /* inverse of quat_from_matrix, same as osg::Matrixd::makeRotate(quat) */
+  static inline rotation_matrix matrix_from_quat(const quaternion& q) {
+    const double x = q[0], y = q[1], z = q[2], w = q[3];
+    const double length2 = x*x + y*y + z*z + w*w;
+    const double r = length2 > 0.0 ? 2.0 / length2 : 0.0;
+
+    const double x2 = r * x, y2 = r * y, z2 = r * z;
+    const double xx = x * x2, xy = x * y2, xz = x * z2;
+    const double yy = y * y2, yz = y * z2, zz = z * z2;
+    const double wx = w * x2, wy = w * y2, wz = w * z2;
+
+    const rotation_matrix m = {{1.0 - (yy + zz), xy + wz, xz - wy,
+				xy - wz, 1.0 - (xx + zz), yz + wx,
+				xz + wy, yz - wx, 1.0 - (xx + yy)}};
+    return m;
+  }
+
+  static inline quaternion quat_normalize(const quaternion& q) {
+    const double length = std::sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    if (!(length > 0.0))
+      return q;
+
+    quaternion n;
+    for (int i = 0; i < 4; i++)
+      n[i] = q[i] / length;
+    return n;
+  }
+
+  static inline double quat_dot(const quaternion& a, const quaternion& b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+  }
+
+  /* angle of the rotation between a and b */
+  static inline double quat_angle(const quaternion& a, const quaternion& b) {
+    return 2.0 * std::acos(std::min(1.0, std::fabs(quat_dot(a, b))));
+  }
+
+  /* spherical interpolation along the shorter arc */
+  static inline quaternion slerp(const quaternion& a, const quaternion& b, const double alpha) {
+    double cosom = quat_dot(a, b);
+    const double sign = cosom < 0.0 ? -1.0 : 1.0;
+    cosom *= sign;
+
+    double sa, sb;
+    if (1.0 - cosom > 1e-6) {
+      const double omega = std::acos(cosom);
+      const double sinom = std::sin(omega);
+      sa = std::sin((1.0 - alpha) * omega) / sinom;
+      sb = std::sin(alpha * omega) / sinom;
+    } else {
+      /* nearly parallel, fall back to linear interpolation */
+      sa = 1.0 - alpha;
+      sb = alpha;
+    }
+
+    quaternion q;
+    for (int i = 0; i < 4; i++)
+      q[i] = sa * a[i] + sign * sb * b[i];
+    return q;
+  }
+
+}
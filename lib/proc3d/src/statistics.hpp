@@ -0,0 +1,133 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <boost/mpl/begin.hpp>
+#include <boost/mpl/distance.hpp>
+#include <boost/mpl/find.hpp>
+#include <boost/mpl/size.hpp>
+
+#include "operations.hpp"
+
+namespace proc3d {
+
+  /* one counter per alternative of AnimOperation, in declaration order */
+  static const std::size_t OP_TYPES = boost::mpl::size<AnimOperation::types>::value;
+
+  /* index of the counter of Op */
+  template <typename Op>
+  struct op_type : boost::mpl::distance<boost::mpl::begin<AnimOperation::types>::type,
+					 typename boost::mpl::find<AnimOperation::types, Op>::type>::type {};
+
+  /*
+    Counters of the delta ops pushed into a context. Counting is a couple of
+    increments per op, the clock and the memory are only sampled every few
+    thousand ops (see AnimationContext::CHECK_INTERVAL), so the statistics
+    can always stay on.
+   */
+  class Statistics {
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    Statistics() : total(0), peakBytes(0), rate(0.0), sampled(0) {
+      std::fill(ops, ops + OP_TYPES, 0);
+    }
+
+    void count(const int type, const object_handle h) {
+      if (!total++)
+	first = clock::now();
+      ops[type]++;
+      if (h >= perObject.size())
+	perObject.resize(h + 1, 0);
+      perObject[h]++;
+    }
+
+    /* bytes is the current memory of the context */
+    void sample(const std::size_t bytes) {
+      peakBytes = std::max(peakBytes, bytes);
+
+      const clock::time_point now = clock::now();
+      const double seconds = std::chrono::duration<double>(now - (sampled ? last : first)).count();
+      if (seconds > 0.0)
+	rate = (total - sampled) / seconds;
+      last = now;
+      sampled = total;
+    }
+
+    uint64_t pushed(const int type) const { return ops[type]; }
+    uint64_t pushed() const { return total; }
+
+    /* ops of object h, 0 for objects that never got one */
+    uint64_t pushed_to(const object_handle h) const {
+      return h < perObject.size() ? perObject[h] : 0;
+    }
+
+    /* the n objects with the most ops, most first */
+    std::vector<object_handle> hottest(const std::size_t n) const {
+      std::vector<object_handle> handles;
+      for (object_handle h = 0; h < perObject.size(); h++)
+	if (perObject[h])
+	  handles.push_back(h);
+
+      const std::size_t k = std::min(n, handles.size());
+      std::partial_sort(handles.begin(), handles.begin() + k, handles.end(), by_count(perObject));
+      handles.resize(k);
+      return handles;
+    }
+
+    std::size_t peak_bytes() const { return peakBytes; }
+
+    /* ops per second over the last sample interval */
+    double recent_rate() const { return rate; }
+
+    /* ops per second from the first op to the last sample */
+    double average_rate() const {
+      const double seconds = sampled ? std::chrono::duration<double>(last - first).count() : 0.0;
+      return seconds > 0.0 ? sampled / seconds : 0.0;
+    }
+
+  private:
+    uint64_t ops[OP_TYPES];
+    uint64_t total;
+    std::vector<uint64_t> perObject;
+
+    std::size_t peakBytes;
+    double rate;
+    uint64_t sampled;	// total at the last sample
+    clock::time_point first, last;
+
+    struct by_count {
+      const std::vector<uint64_t>& counts;
+      by_count(const std::vector<uint64_t>& c) : counts(c) {}
+      bool operator()(const object_handle a, const object_handle b) const {
+	return counts[a] > counts[b];
+      }
+    };
+  };
+
+}
@@ -0,0 +1,219 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "operations.hpp"
+
+namespace proc3d {
+
+  struct get_time : boost::static_visitor<double> {
+    template <typename T>
+    double operator()(const T& op) const {
+      return op.time;
+    }
+  };
+
+  template <typename Variant>
+  static inline double time_of(const Variant& op) {
+    return boost::apply_visitor( get_time(), op );
+  }
+
+  struct get_handle : boost::static_visitor<object_handle> {
+    template <typename T>
+    object_handle operator()(const T& op) const {
+      return op.handle;
+    }
+  };
+
+  template <typename Variant>
+  static inline object_handle handle_of(const Variant& op) {
+    return boost::apply_visitor( get_handle(), op );
+  }
+
+  /* the property or parameter an op sets, 0 for ops that set the whole state of their kind */
+  struct get_slot : boost::static_visitor<unsigned int> {
+    template <typename T>
+    unsigned int operator()(const T&) const {
+      return 0;
+    }
+
+    unsigned int operator()(const SetMaterialProperty& op) const { return op.property; }
+    unsigned int operator()(const SetShapeParameter& op) const { return op.parameter; }
+  };
+
+  /* what an op sets: object, kind and slot. The latest op of every key makes up the state. */
+  typedef std::pair<object_handle, std::pair<int, unsigned int> > op_key;
+
+  static inline op_key key_of(const TimelineOperation& op) {
+    return std::make_pair(handle_of(op), std::make_pair(op.which(), boost::apply_visitor( get_slot(), op )));
+  }
+
+  /*
+    Append only, time ordered list of delta ops.
+    Simulation time only moves forward, so an op is usually just appended.
+    Ops that arrive late (e.g. from a second controller) are buffered and
+    merged in by commit(), which has to be called before the timeline is read.
+   */
+  class Timeline {
+  public:
+    Timeline() : last(-std::numeric_limits<double>::infinity()) {}
+
+    void push(const TimelineOperation& op) {
+      const double t = time_of(op);
+      if (t >= last) {
+	times.push_back(t);
+	ops.push_back(op);
+	last = t;
+      } else {
+	late.push_back(std::make_pair(t, op));
+      }
+    }
+
+    void commit() {
+      if (late.empty())
+	return;
+
+      std::stable_sort(late.begin(), late.end(), earlier);
+
+      std::vector<double> mergedTimes;
+      std::vector<TimelineOperation> mergedOps;
+      mergedTimes.reserve(times.size() + late.size());
+      mergedOps.reserve(ops.size() + late.size());
+
+      /* on equal time stamps the op that arrived first stays first */
+      std::size_t i = 0, j = 0;
+      while (i < times.size() || j < late.size()) {
+	if (j == late.size() || (i < times.size() && times[i] <= late[j].first)) {
+	  mergedTimes.push_back(times[i]);
+	  mergedOps.push_back(ops[i++]);
+	} else {
+	  mergedTimes.push_back(late[j].first);
+	  mergedOps.push_back(late[j++].second);
+	}
+      }
+
+      times.swap(mergedTimes);
+      ops.swap(mergedOps);
+      late.clear();
+      last = times.back();
+    }
+
+    void clear() {
+      times.clear();
+      ops.clear();
+      late.clear();
+      last = -std::numeric_limits<double>::infinity();
+    }
+
+    /*
+      Move the ops before end to sealed. The latest op of every key (see
+      key_of) also stays, so the remaining timeline still restores the state
+      at end.
+     */
+    void split(const double end, Timeline& sealed) {
+      cut(end, &sealed);
+    }
+
+    /* like split, but the ops before end are dropped */
+    void drop_before(const double end) {
+      cut(end, NULL);
+    }
+
+    /* approximate memory held by the ops */
+    std::size_t bytes() const {
+      return times.capacity() * sizeof(double) + ops.capacity() * sizeof(TimelineOperation)
+	+ late.capacity() * sizeof(late_op);
+    }
+
+    bool empty() const { return ops.empty() && late.empty(); }
+
+    /* number of ops including those not yet committed */
+    std::size_t size() const { return ops.size() + late.size(); }
+
+    /* committed ops, in time order */
+    std::size_t committed() const { return ops.size(); }
+
+    const TimelineOperation& operator[](const std::size_t i) const { return ops[i]; }
+
+    double time(const std::size_t i) const { return times[i]; }
+
+    /* time of the first committed op or +inf if there is none */
+    double start_time() const {
+      return times.empty() ? std::numeric_limits<double>::infinity() : times.front();
+    }
+
+    /* time of the last committed op or -inf if there is none */
+    double end_time() const {
+      return times.empty() ? -std::numeric_limits<double>::infinity() : times.back();
+    }
+
+  private:
+    typedef std::pair<double, TimelineOperation> late_op;
+
+    std::vector<double> times;
+    std::vector<TimelineOperation> ops;
+    std::vector<late_op> late;
+    double last;
+
+    static bool earlier(const late_op& a, const late_op& b) {
+      return a.first < b.first;
+    }
+
+    void cut(const double end, Timeline* sealed) {
+      commit();
+      const std::size_t n = std::lower_bound(times.begin(), times.end(), end) - times.begin();
+
+      std::map<op_key, std::size_t> latest;
+      for (std::size_t i = 0; i < n; i++) {
+	if (sealed)
+	  sealed->push(ops[i]);
+	latest[key_of(ops[i])] = i;
+      }
+
+      std::vector<std::size_t> keep;
+      for (std::map<op_key, std::size_t>::const_iterator i = latest.begin(); i != latest.end(); i++)
+	keep.push_back(i->second);
+      std::sort(keep.begin(), keep.end());
+
+      std::vector<double> keptTimes;
+      std::vector<TimelineOperation> keptOps;
+      keptTimes.reserve(keep.size() + times.size() - n);
+      keptOps.reserve(keep.size() + ops.size() - n);
+      for (std::vector<std::size_t>::const_iterator i = keep.begin(); i != keep.end(); i++) {
+	keptTimes.push_back(times[*i]);
+	keptOps.push_back(ops[*i]);
+      }
+      keptTimes.insert(keptTimes.end(), times.begin() + n, times.end());
+      keptOps.insert(keptOps.end(), ops.begin() + n, ops.end());
+
+      times.swap(keptTimes);
+      ops.swap(keptOps);
+    }
+  };
+
+}
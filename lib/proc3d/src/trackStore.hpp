@@ -0,0 +1,456 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <boost/array.hpp>
+#include <boost/optional.hpp>
+
+#include "operations.hpp"
+#include "rotations.hpp"
+#include "interpolation.hpp"
+#include "workerPool.hpp"
+
+namespace proc3d {
+
+  /* key values are quantized to float if PROC3D_FLOAT_TRACKS is defined, time stamps never are */
+#ifdef PROC3D_FLOAT_TRACKS
+  typedef float track_scalar;
+#else
+  typedef double track_scalar;
+#endif
+
+  /*
+    A single keyframe channel of one object. Keys are kept sorted by time,
+    times and values live in two separate arrays so that searching only
+    touches the times. Values are handed in and out as doubles, every key
+    is a fixed size record of N track_scalars.
+   */
+  template <std::size_t N>
+  struct Channel {
+    typedef boost::array<double, N> value_type;
+    typedef boost::array<track_scalar, N> stored_type;
+
+    std::vector<double> times;
+    std::vector<stored_type> values;
+
+    void insert(const double t, const value_type& v) {
+      /* simulation time only moves forward, so this is almost always an append */
+      if (times.empty() || times.back() <= t) {
+	times.push_back(t);
+	values.push_back(store(v));
+	return;
+      }
+
+      const std::size_t i = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+      times.insert(times.begin() + i, t);
+      values.insert(values.begin() + i, store(v));
+    }
+
+    /*
+      Drop the keys before t except the latest keep of them (the state at t
+      and what the decimator looks at). Copies instead of erasing, so the
+      memory is actually freed.
+     */
+    void drop_before(const double t, const std::size_t keep) {
+      const std::size_t n = std::lower_bound(times.begin(), times.end(), t) - times.begin();
+      if (n <= keep)
+	return;
+
+      std::vector<double>(times.begin() + (n - keep), times.end()).swap(times);
+      std::vector<stored_type>(values.begin() + (n - keep), values.end()).swap(values);
+    }
+
+    /* overwrite the last key */
+    void replace_last(const double t, const value_type& v) {
+      times.back() = t;
+      values.back() = store(v);
+    }
+
+    value_type value(const std::size_t i) const {
+      value_type v;
+      std::copy(values[i].begin(), values[i].end(), v.begin());
+      return v;
+    }
+
+    /* number of keys with a time stamp <= t */
+    std::size_t keys_until(const double t) const {
+      return std::upper_bound(times.begin(), times.end(), t) - times.begin();
+    }
+
+    boost::optional<value_type> at(const double t) const {
+      const std::size_t n = keys_until(t);
+      if (n == 0)
+	return boost::none;
+      return value(n - 1);
+    }
+
+    bool empty() const { return times.empty(); }
+
+    std::size_t size() const { return times.size(); }
+
+  private:
+    static stored_type store(const value_type& v) {
+      stored_type s;
+      std::copy(v.begin(), v.end(), s.begin());
+      return s;
+    }
+  };
+
+  struct ObjectTracks {
+    Channel<3> translation;
+    Channel<4> rotation;	// normalized quaternion, see rotations.hpp
+    Channel<3> scale;
+    Channel<4> ambient;
+    Channel<4> diffuse;
+    Channel<4> specular;
+  };
+
+  /* the state of one object at some point in time, unset channels had no key yet */
+  struct ObjectState {
+    boost::optional<Channel<3>::value_type> translation;
+    boost::optional<Channel<4>::value_type> rotation;
+    boost::optional<Channel<3>::value_type> scale;
+    boost::optional<Channel<4>::value_type> ambient;
+    boost::optional<Channel<4>::value_type> diffuse;
+    boost::optional<Channel<4>::value_type> specular;
+  };
+
+  /* per object keyframe tracks, indexed by object handle */
+  class TrackStore {
+  public:
+    ObjectTracks& operator[](const object_handle handle) {
+      if (handle >= objects.size())
+	objects.resize(handle + 1);
+      return objects[handle];
+    }
+
+    const ObjectTracks& operator[](const object_handle handle) const {
+      return objects[handle];
+    }
+
+    std::size_t size() const {
+      return objects.size();
+    }
+
+    void clear() {
+      objects.clear();
+    }
+
+    ObjectState state_at(const object_handle handle, const double t) const {
+      ObjectState state;
+      if (handle >= objects.size())
+	return state;
+
+      const ObjectTracks& obj = objects[handle];
+      state.translation = obj.translation.at(t);
+      state.rotation = obj.rotation.at(t);
+      state.scale = obj.scale.at(t);
+      state.ambient = obj.ambient.at(t);
+      state.diffuse = obj.diffuse.at(t);
+      state.specular = obj.specular.at(t);
+      return state;
+    }
+
+    /* approximate memory held by the keys */
+    std::size_t bytes() const {
+      std::size_t n = 0;
+      for (std::vector<ObjectTracks>::const_iterator i = objects.begin(); i != objects.end(); i++)
+	n += bytes(i->translation) + bytes(i->rotation) + bytes(i->scale)
+	  + bytes(i->ambient) + bytes(i->diffuse) + bytes(i->specular);
+      return n;
+    }
+
+    /* total number of keys in all channels */
+    std::size_t keyframes() const {
+      std::size_t n = 0;
+      for (std::vector<ObjectTracks>::const_iterator i = objects.begin(); i != objects.end(); i++)
+	n += i->translation.size() + i->rotation.size() + i->scale.size()
+	  + i->ambient.size() + i->diffuse.size() + i->specular.size();
+      return n;
+    }
+
+    /* time of the earliest key or +inf if there is none */
+    double start_time() const {
+      double t = std::numeric_limits<double>::infinity();
+      for (std::vector<ObjectTracks>::const_iterator i = objects.begin(); i != objects.end(); i++) {
+	t = std::min(t, first(i->translation)); t = std::min(t, first(i->rotation));
+	t = std::min(t, first(i->scale)); t = std::min(t, first(i->ambient));
+	t = std::min(t, first(i->diffuse)); t = std::min(t, first(i->specular));
+      }
+      return t;
+    }
+
+    /* time of the latest key or -inf if there is none */
+    double end_time() const {
+      double t = -std::numeric_limits<double>::infinity();
+      for (std::vector<ObjectTracks>::const_iterator i = objects.begin(); i != objects.end(); i++) {
+	t = std::max(t, last(i->translation)); t = std::max(t, last(i->rotation));
+	t = std::max(t, last(i->scale)); t = std::max(t, last(i->ambient));
+	t = std::max(t, last(i->diffuse)); t = std::max(t, last(i->specular));
+      }
+      return t;
+    }
+
+  private:
+    std::vector<ObjectTracks> objects;
+
+    template <std::size_t N>
+    static std::size_t bytes(const Channel<N>& channel) {
+      return channel.times.capacity() * sizeof(double) + channel.values.capacity() * sizeof(typename Channel<N>::stored_type);
+    }
+
+    template <std::size_t N>
+    static double first(const Channel<N>& channel) {
+      return channel.empty() ? std::numeric_limits<double>::infinity() : channel.times.front();
+    }
+
+    template <std::size_t N>
+    static double last(const Channel<N>& channel) {
+      return channel.empty() ? -std::numeric_limits<double>::infinity() : channel.times.back();
+    }
+  };
+
+  /* value between two keys, rotations use slerp instead */
+  template <std::size_t N>
+  static inline boost::array<double, N> lerp(const boost::array<double, N>& a, const boost::array<double, N>& b, const double alpha) {
+    boost::array<double, N> v;
+    for (std::size_t i = 0; i < N; i++)
+      v[i] = a[i] + alpha * (b[i] - a[i]);
+    return v;
+  }
+
+  /* read position in all channels of one object, i.e. the number of keys passed */
+  struct TrackPosition {
+    TrackPosition() : translation(0), rotation(0), scale(0), ambient(0), diffuse(0), specular(0) {}
+    unsigned int translation, rotation, scale, ambient, diffuse, specular;
+  };
+
+  /* everything one slice of objects hands to the sink at one point in time */
+  struct TrackOutput {
+    typedef std::vector<std::pair<object_handle, Channel<3>::value_type> > keys3;
+    typedef std::vector<std::pair<object_handle, Channel<4>::value_type> > keys4;
+
+    Spans<3> translations;	// interpolated
+    Spans<4> rotations;
+    keys3 translationKeys, scaleKeys;	// handed over as they are
+    keys4 rotationKeys, ambientKeys, diffuseKeys, specularKeys;
+    bool pending;
+
+    void clear() {
+      translations.clear(); rotations.clear();
+      translationKeys.clear(); scaleKeys.clear();
+      rotationKeys.clear(); ambientKeys.clear(); diffuseKeys.clear(); specularKeys.clear();
+      pending = false;
+    }
+
+    template <typename Sink>
+    void emit(const Sink& sink) const {
+      for (std::size_t i = 0; i < translations.size(); i++)
+	sink.set_translation(translations.handle(i), translations.value(i));
+      for (std::size_t i = 0; i < rotations.size(); i++)
+	sink.set_rotation(rotations.handle(i), rotations.value(i));
+
+      for (keys3::const_iterator i = translationKeys.begin(); i != translationKeys.end(); i++)
+	sink.set_translation(i->first, i->second);
+      for (keys4::const_iterator i = rotationKeys.begin(); i != rotationKeys.end(); i++)
+	sink.set_rotation(i->first, i->second);
+      for (keys3::const_iterator i = scaleKeys.begin(); i != scaleKeys.end(); i++)
+	sink.set_scale(i->first, i->second);
+      for (keys4::const_iterator i = ambientKeys.begin(); i != ambientKeys.end(); i++)
+	sink.set_ambient(i->first, i->second);
+      for (keys4::const_iterator i = diffuseKeys.begin(); i != diffuseKeys.end(); i++)
+	sink.set_diffuse(i->first, i->second);
+      for (keys4::const_iterator i = specularKeys.begin(); i != specularKeys.end(); i++)
+	sink.set_specular(i->first, i->second);
+    }
+  };
+
+  /*
+    Plays a track store forward in time. For every channel that passed a key
+    since the last call, the newest value is handed to the sink, which has to
+    provide set_translation, set_rotation (a quaternion), set_scale, set_ambient,
+    set_diffuse and set_specular. With smooth set, translations and rotations are
+    interpolated between their keys and handed over on every call; all objects
+    between two keys are gathered and interpolated together (see interpolation.hpp).
+
+    With a pool, large stores are split into slices of objects that are
+    evaluated in parallel, the sink is then called from the calling thread only.
+   */
+  class TrackCursor {
+  public:
+    /* fewer objects per slice are not worth waking a worker */
+    static const std::size_t SLICE_OBJECTS = 1024;
+
+    TrackCursor(const TrackStore& s) : smooth(true), pool(NULL), store(s) {}
+
+    bool smooth;
+    WorkerPool* pool;	// not owned, NULL evaluates everything in the calling thread
+
+    void reset() {
+      cursors.assign(store.size(), TrackPosition());
+    }
+
+    /* returns true as long as there are keys after t */
+    template <typename Sink>
+    bool advance(const double t, const Sink& sink) {
+      if (cursors.size() < store.size())
+	cursors.resize(store.size());
+
+      return play(t, false, sink);
+    }
+
+    /*
+      Continue from a saved position (which must not be after t) up to t and
+      hand the complete state of every object to the sink. Channels whose
+      first key comes after t hand over that key.
+     */
+    template <typename Sink>
+    void seek(const std::vector<TrackPosition>& from, const double t, const Sink& sink) {
+      cursors = from;
+      cursors.resize(store.size());
+
+      play(t, true, sink);
+    }
+
+    const std::vector<TrackPosition>& positions() const {
+      return cursors;
+    }
+
+  private:
+    const TrackStore& store;
+    std::vector<TrackPosition> cursors;
+    std::vector<TrackOutput> slices;	// reused on every call
+
+    /* what update() found for a channel */
+    enum Step { UNCHANGED, KEY, SPAN };
+
+    /* evaluates slice i of n for run() */
+    struct evaluate_slice {
+      TrackCursor& cursor;
+      const std::size_t n;
+      const double t;
+      const bool all;
+
+      evaluate_slice(TrackCursor& c, const std::size_t n, const double t, const bool all) : cursor(c), n(n), t(t), all(all) {}
+
+      void operator()(const std::size_t i) const {
+	const std::size_t objects = cursor.store.size();
+	cursor.evaluate(cursor.slices[i], i * objects / n, (i + 1) * objects / n, t, all);
+      }
+    };
+
+    template <typename Sink>
+    bool play(const double t, const bool all, const Sink& sink) {
+      std::size_t n = 1;
+      if (pool)
+	n = std::max<std::size_t>(1, std::min(pool->size(), store.size() / SLICE_OBJECTS));
+      if (slices.size() < n)
+	slices.resize(n);
+
+      if (n == 1)
+	evaluate(slices[0], 0, store.size(), t, all);
+      else
+	pool->run(n, WorkerPool::Task(evaluate_slice(*this, n, t, all)));
+
+      bool pending = false;
+      for (std::size_t i = 0; i < n; i++) {
+	slices[i].emit(sink);
+	pending = pending || slices[i].pending;
+      }
+      return pending;
+    }
+
+    /* move the cursors of objects [first, last) to t and compute their values */
+    void evaluate(TrackOutput& out, const object_handle first, const object_handle last, const double t, const bool all) {
+      out.clear();
+
+      bool& pending = out.pending;
+      for (object_handle h = first; h < last; h++) {
+	const ObjectTracks& obj = store[h];
+	TrackPosition& c = cursors[h];
+
+	switch (update(obj.translation, c.translation, t, smooth, all, pending)) {
+	case KEY: out.translationKeys.push_back(std::make_pair(h, latest(obj.translation, c.translation))); break;
+	case SPAN: add_span(out.translations, h, obj.translation, c.translation, t); break;
+	default: break;
+	}
+	switch (update(obj.rotation, c.rotation, t, smooth, all, pending)) {
+	case KEY: out.rotationKeys.push_back(std::make_pair(h, latest(obj.rotation, c.rotation))); break;
+	case SPAN: add_span(out.rotations, h, obj.rotation, c.rotation, t); break;
+	default: break;
+	}
+	if (update(obj.scale, c.scale, t, false, all, pending) == KEY)
+	  out.scaleKeys.push_back(std::make_pair(h, latest(obj.scale, c.scale)));
+	if (update(obj.ambient, c.ambient, t, false, all, pending) == KEY)
+	  out.ambientKeys.push_back(std::make_pair(h, latest(obj.ambient, c.ambient)));
+	if (update(obj.diffuse, c.diffuse, t, false, all, pending) == KEY)
+	  out.diffuseKeys.push_back(std::make_pair(h, latest(obj.diffuse, c.diffuse)));
+	if (update(obj.specular, c.specular, t, false, all, pending) == KEY)
+	  out.specularKeys.push_back(std::make_pair(h, latest(obj.specular, c.specular)));
+      }
+
+      out.translations.lerp();
+      out.rotations.slerp();
+    }
+
+    /* the keys around t, cursor is the first key after t */
+    template <std::size_t N>
+    static void add_span(Spans<N>& spans, const object_handle h, const Channel<N>& channel, const unsigned int cursor, const double t) {
+      const double t0 = channel.times[cursor - 1], t1 = channel.times[cursor];
+      spans.add(h, channel.value(cursor - 1), channel.value(cursor), (t - t0) / (t1 - t0));
+    }
+
+    /* the last key before the cursor, the first one for a full state before any key */
+    template <std::size_t N>
+    static typename Channel<N>::value_type latest(const Channel<N>& channel, const unsigned int cursor) {
+      return channel.value(cursor ? cursor - 1 : 0);
+    }
+
+    /* move the cursor to t, tells whether the last key or a span has to be handed to the sink */
+    template <std::size_t N>
+    static Step update(const Channel<N>& channel, unsigned int& cursor, const double t, const bool interpolated,
+		       const bool all, bool& pending) {
+      const unsigned int old = cursor;
+      while (cursor < channel.times.size() && channel.times[cursor] <= t)
+	cursor++;
+
+      const bool more = cursor < channel.times.size();
+      pending = pending || more;
+      if (cursor == 0)
+	return all && more ? KEY : UNCHANGED;
+
+      if (interpolated && more)
+	return SPAN;
+
+      if (cursor == old && !all)
+	return UNCHANGED;
+
+      return KEY;
+    }
+  };
+
+}
@@ -0,0 +1,119 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace proc3d {
+
+  /*
+    A fixed set of threads that run the tasks of one call to run() at a
+    time. The calling thread works on the tasks as well, so a pool of size()
+    n has n - 1 threads of its own.
+   */
+  class WorkerPool {
+  public:
+    typedef std::function<void (std::size_t)> Task;
+
+    /* one thread per core by default */
+    WorkerPool(std::size_t threads = std::thread::hardware_concurrency())
+      : task(NULL), tasks(0), next(0), finished(0), generation(0), stop(false) {
+      for (std::size_t i = 1; i < threads; i++)
+	workers.push_back(std::thread(&WorkerPool::work, this));
+    }
+
+    ~WorkerPool() {
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	stop = true;
+      }
+      wake.notify_all();
+      for (std::size_t i = 0; i < workers.size(); i++)
+	workers[i].join();
+    }
+
+    std::size_t size() const { return workers.size() + 1; }
+
+    /* run f(0) to f(n - 1) and return once all of them are done */
+    void run(const std::size_t n, const Task& f) {
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	task = &f;
+	tasks = n;
+	next = finished = 0;
+	generation++;
+      }
+      wake.notify_all();
+
+      std::unique_lock<std::mutex> lock(mutex);
+      take(lock);
+      while (finished < tasks)
+	done.wait(lock);
+      task = NULL;
+    }
+
+  private:
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+
+    /* the current run(), guarded by mutex */
+    const Task* task;
+    std::size_t tasks, next, finished;
+    unsigned long generation;
+    bool stop;
+
+    /* work on tasks until none is left, lock is held on entry and exit */
+    void take(std::unique_lock<std::mutex>& lock) {
+      while (next < tasks) {
+	const std::size_t i = next++;
+	lock.unlock();
+	(*task)(i);
+	lock.lock();
+	if (++finished == tasks)
+	  done.notify_all();
+      }
+    }
+
+    void work() {
+      unsigned long seen = 0;
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+	while (!stop && generation == seen)
+	  wake.wait(lock);
+	if (stop)
+	  return;
+
+	seen = generation;
+	take(lock);
+      }
+    }
+  };
+
+}
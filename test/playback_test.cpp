@@ -0,0 +1,126 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+/*
+  Seeking a Playback forward and back again: the sink has to end up with the
+  state at the target time, also for objects whose first key or first
+  timeline op comes after it.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <utility>
+
+#include "animationContext.hpp"
+#include "playback.hpp"
+#include "test_support.hpp"
+
+using namespace proc3d;
+
+/* key values are stored as track_scalar */
+static const double TOLERANCE = sizeof(track_scalar) < sizeof(double) ? 1e-5 : 1e-12;
+
+/* what a viewer would show */
+struct Scene {
+  std::map<object_handle, Channel<3>::value_type> translations;
+  std::map<object_handle, Channel<4>::value_type> ambients;
+  std::map<std::pair<object_handle, unsigned int>, double> parameters;	// set by the timeline
+  std::map<object_handle, double> euler;				// x angle, set by the timeline
+};
+
+struct SceneSink : boost::static_visitor<> {
+  Scene& scene;
+
+  SceneSink(Scene& s) : scene(s) {}
+
+  void operator()(const RotateEuler& op) const { scene.euler[op.handle] = op.x; }
+  void operator()(const SetMaterialProperty&) const {}
+  void operator()(const SetShapeParameter& op) const { scene.parameters[std::make_pair(op.handle, op.parameter)] = op.value; }
+
+  void set_translation(const object_handle h, const Channel<3>::value_type& v) const { scene.translations[h] = v; }
+  void set_rotation(const object_handle, const Channel<4>::value_type&) const {}
+  void set_scale(const object_handle, const Channel<3>::value_type&) const {}
+  void set_ambient(const object_handle h, const Channel<4>::value_type& v) const { scene.ambients[h] = v; }
+  void set_diffuse(const object_handle, const Channel<4>::value_type&) const {}
+  void set_specular(const object_handle, const Channel<4>::value_type&) const {}
+
+  /* the setup has neither parameters nor Euler angles */
+  void restore_setup() const {
+    scene.parameters.clear();
+    scene.euler.clear();
+  }
+};
+
+static void forward_and_back(const double interval) {
+  AnimationContext context;
+  const object_handle early = context.registry.intern("early"), late = context.registry.intern("late");
+
+  double p[3];
+  for (int k = 0; k <= 200; k++) {
+    position(0, k, p);
+    context.push(Move(early, k * DT, p[0], p[1], p[2]));
+  }
+  /* late only starts moving at 1, and its timeline ops and colors come at 1 too */
+  for (int k = 100; k <= 200; k += 50) {
+    position(1, k, p);
+    context.push(Move(late, k * DT, p[0], p[1], p[2]));
+  }
+  context.push(SetAmbientColor(late, 1.0, 0.5, 0.25, 0.125, 1.0));
+  context.push(SetAmbientColor(late, 1.2, 0.75, 0.25, 0.125, 1.0));
+  context.push(RotateEuler(late, 1.0, 0.3, 0, 0));
+  context.push(SetShapeParameter(late, 1.0, SHAPE_LENGTH, 5.0));
+  context.commit();
+
+  Playback playback(context);
+  if (interval > 0)
+    playback.build_checkpoints(interval);
+
+  Scene scene;
+  const SceneSink sink(scene);
+
+  playback.seek(1.5, sink);
+  CHECK(scene.translations.count(late) == 1 && std::fabs(scene.ambients[late][0] - 0.75) <= TOLERANCE);
+  CHECK(scene.euler.count(late) == 1 && scene.parameters.size() == 1);
+
+  playback.seek(0.5, sink);
+  position(0, 50, p);
+  for (int j = 0; j < 3; j++)
+    CHECK(std::fabs(scene.translations[early][j] - p[j]) <= TOLERANCE * (1 + std::fabs(p[j])));
+
+  /* late is where its first key puts it, the timeline ops of 1 are undone */
+  position(1, 100, p);
+  for (int j = 0; j < 3; j++)
+    CHECK(std::fabs(scene.translations[late][j] - p[j]) <= TOLERANCE * (1 + std::fabs(p[j])));
+  CHECK(std::fabs(scene.ambients[late][0] - 0.5) <= TOLERANCE);
+  CHECK(scene.euler.empty() && scene.parameters.empty());
+
+  /* and forward again */
+  playback.seek(1.0, sink);
+  CHECK(scene.euler.count(late) == 1 && scene.parameters.size() == 1);
+}
+
+int main() {
+  forward_and_back(0);
+  forward_and_back(0.25);
+
+  return finish();
+}
@@ -0,0 +1,201 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+/*
+  Round trips of recordings: an animation saved at once and one spilled
+  while it is pushed, both opened as a Recording and compared with what
+  was pushed at every few steps. A corrupt window has to load empty.
+ */
+
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "proc3d.hpp"
+#include "recording.hpp"
+#include "rotations.hpp"
+#include "test_support.hpp"
+
+using namespace proc3d;
+
+static const int BODIES = 4, STEPS = 12000, COLOR_STEPS = 100;
+
+/* key values are stored as track_scalar */
+static const double TOLERANCE = sizeof(track_scalar) < sizeof(double) ? 1e-5 : 1e-12;
+
+static std::string body(const int i) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "body[%d]", i);
+  return name;
+}
+
+static void push(void* context) {
+  for (int i = 0; i < BODIES; i++)
+    proc3d_create_box(context, body(i).c_str(), 0, 0, 0, 1, 1, 1);
+
+  for (int k = 0; k < STEPS; k++) {
+    const double t = k * DT;
+    for (int i = 0; i < BODIES; i++) {
+      const std::string name = body(i);
+      double p[3];
+      position(i, k, p);
+      rotation_matrix m;
+      rotation(i, k, m.c_array());
+      proc3d_set_translation(context, name.c_str(), p[0], p[1], p[2], t);
+      proc3d_set_rotation_matrix(context, name.c_str(), m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8], t);
+      if (k % COLOR_STEPS == 0) {
+	proc3d_set_ambient_color(context, name.c_str(), 0.001 * k, 0.5, 0.25, 1.0, t);
+	proc3d_set_shape_parameter(context, name.c_str(), 0, 1.0 + k, t);
+      }
+    }
+  }
+}
+
+/* compare the recording with what push() pushed, at every few steps */
+static void compare(Recording& recording) {
+  const AnimationContext& context = recording.context();
+  CHECK(context.setupOps.size() == std::size_t(BODIES));
+  CHECK(recording.start_time() == 0.0);
+  CHECK(std::fabs(recording.end_time() - (STEPS - 1) * DT) < 1e-9);
+
+  std::size_t loads = 0;
+  for (int k = 0; k < STEPS; k += 7) {
+    const double t = k * DT;
+    loads += recording.load(t);
+    CHECK(recording.contains(t));
+    CHECK(context.deltaOps.size() > 0);
+
+    for (int i = 0; i < BODIES; i++) {
+      object_handle h = 0;
+      CHECK(context.registry.lookup(body(i), h));
+      const ObjectState state = context.tracks.state_at(h, t);
+      CHECK(state.translation && state.rotation && state.ambient);
+      if (!state.translation || !state.rotation || !state.ambient)
+	return;
+
+      double p[3];
+      position(i, k, p);
+      for (int j = 0; j < 3; j++)
+	CHECK(std::fabs((*state.translation)[j] - p[j]) <= TOLERANCE * (1 + std::fabs(p[j])));
+
+      // q and -q are the same rotation
+      rotation_matrix m;
+      rotation(i, k, m.c_array());
+      const quaternion q = quat_normalize(quat_from_matrix(m));
+      CHECK(1 - std::fabs(quat_dot(q, *state.rotation)) <= TOLERANCE);
+
+      CHECK(std::fabs((*state.ambient)[0] - 0.001 * (k - k % COLOR_STEPS)) <= TOLERANCE);
+    }
+  }
+  CHECK(loads > 1);	// the animation takes several windows
+}
+
+static std::string temporary(const char* what) {
+  char name[64];
+  std::snprintf(name, sizeof(name), "recording_test_%s_%d.m3d", what, int(getpid()));
+  return name;
+}
+
+static void saved() {
+  const std::string file = temporary("saved");
+  void* context = proc3d_animation_context_new();
+  push(context);
+  CHECK(proc3d_save_recording(context, file.c_str()) == 0);
+  proc3d_animation_context_free(context);
+
+  Recording recording;
+  CHECK(recording.open(file));
+  compare(recording);
+  recording.close();
+  std::remove(file.c_str());
+}
+
+static void spilled() {
+  const std::string file = temporary("spilled");
+  void* context = proc3d_animation_context_new();
+  CHECK(proc3d_spill_to(context, file.c_str(), 1.0) == 0);
+  push(context);
+  CHECK(proc3d_save_recording(context, file.c_str()) == 0);
+  proc3d_animation_context_free(context);
+
+  Recording recording;
+  CHECK(recording.open(file));
+  compare(recording);
+  recording.close();
+  std::remove(file.c_str());
+}
+
+static void corrupt() {
+  const std::string file = temporary("corrupt");
+  void* context = proc3d_animation_context_new();
+  push(context);
+  CHECK(proc3d_save_recording(context, file.c_str()) == 0);
+  proc3d_animation_context_free(context);
+
+  std::vector<char> bytes;
+  {
+    std::ifstream in(file.c_str(), std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  RecordingHeader header;
+  CHECK(bytes.size() >= sizeof(header));
+  if (bytes.size() < sizeof(header))
+    return;
+  std::memcpy(&header, &bytes[0], sizeof(header));
+
+  /* a key count of the first object of the last window beyond the file */
+  WindowIndex last;
+  std::memcpy(&last, &bytes[header.index_offset + (header.windows - 1) * sizeof(WindowIndex)], sizeof(last));
+  const uint32_t keys = 0xffffffffu;
+  std::memcpy(&bytes[last.offset + sizeof(uint32_t)], &keys, sizeof(keys));
+  {
+    std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(&bytes[0], bytes.size());
+  }
+
+  Recording recording;
+  CHECK(recording.open(file));
+  recording.load(last.start);
+  CHECK(recording.context().tracks.size() == 0);
+  recording.close();
+
+  /* a file that ends within its index is not opened */
+  {
+    std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(&bytes[0], header.index_offset + sizeof(WindowIndex) / 2);
+  }
+  CHECK(!recording.open(file));
+  std::remove(file.c_str());
+}
+
+int main() {
+  saved();
+  spilled();
+  corrupt();
+
+  return finish();
+}
@@ -0,0 +1,79 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+/*
+  What the tests share: CHECK, which counts failed checks instead of
+  stopping, and the trajectories of the test bodies.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static int failures = 0;
+
+#define CHECK(c) check((c), #c, __LINE__)
+
+static inline void check(const bool ok, const char* what, const int line) {
+  if (!ok) {
+    std::fprintf(stderr, "line %d: %s failed\n", line, what);
+    failures++;
+  }
+}
+
+/* the time between two steps of the trajectories */
+static const double DT = 0.01;
+
+/* the position of body i at step k */
+static inline void position(const int i, const int k, double* p) {
+  const double t = k * DT;
+  p[0] = 2 * std::sin(t + i);
+  p[1] = 0.1 * i + 0.5 * t;
+  p[2] = std::cos(3 * t + i) - 0.3 * t * t;
+}
+
+/* the rotation of body i at step k, row major */
+static inline void rotation(const int i, const int k, double* m) {
+  const double a = 0.05 * k + i, ax[3] = {std::sin(i), std::cos(i), 0.5};
+  const double n = std::sqrt(ax[0] * ax[0] + ax[1] * ax[1] + ax[2] * ax[2]);
+  const double x = ax[0] / n, y = ax[1] / n, z = ax[2] / n, c = std::cos(a), s = std::sin(a), C = 1 - c;
+  const double r[9] = {c + x * x * C, x * y * C - z * s, x * z * C + y * s,
+		       y * x * C + z * s, c + y * y * C, y * z * C - x * s,
+		       z * x * C - y * s, z * y * C + x * s, c + z * z * C};
+  std::memcpy(m, r, sizeof(r));
+}
+
+static inline double max_error(const double* a, const double* b, const int n) {
+  double e = 0;
+  for (int i = 0; i < n; i++)
+    e = std::max(e, std::fabs(a[i] - b[i]));
+  return e;
+}
+
+/* the checks of a test program, as its exit status */
+static inline int finish() {
+  if (failures)
+    std::fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}
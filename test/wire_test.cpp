@@ -0,0 +1,438 @@
+/*
+  This file is part of the Modelica3D package.
+
+  Copyright (C) 2012-current year  Christoph Höger and Technical University of Berlin
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/lgpl.html>.
+
+  Main Author 2010-2013, Christoph Höger
+ */
+
+/*
+  Round trips of the wire formats of modbus_wire.h: packed transforms
+  encoded as a frame does, decoded by PackedReader and proc3d_apply_packed,
+  and a shared memory ring written as modbus_ring_add does, read by
+  RingReader.
+ */
+
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modbus.h"
+#include "modbus_wire.h"
+#include "packed.hpp"
+#include "ring.hpp"
+#include "proc3d.hpp"
+#include "test_support.hpp"
+
+using namespace proc3d;
+
+/* packed transforms written as frame_pack in modbus.c writes them */
+struct Packer {
+  double quantum;
+  std::vector<ModbusPacked> sent;
+  std::vector<uint8_t> bytes;
+
+  Packer(const double q) : quantum(q) {}
+
+  /* false for values that go in full */
+  bool record(const uint32_t number, const std::string& name, const int op, const double* values) {
+    int64_t value[3];
+    const int dropped = modbus_pack_values(op, values, quantum, value);
+    if (dropped < 0)
+      return false;
+
+    if (number >= sent.size())
+      sent.resize(number + 1, ModbusPacked());
+    const std::size_t size = bytes.size();
+    bytes.resize(size + name.size() + MODBUS_PACKED_RECORD_BYTES);
+    bytes.resize(size + modbus_pack_record(&bytes[size], &sent[number], number, name.data(), name.size(),
+					   op, value, dropped, MODBUS_KEYFRAME_INTERVAL));
+    return true;
+  }
+
+  void resync() {
+    modbus_packed_resync(sent.data(), uint32_t(sent.size()));
+  }
+
+  /* whether each record written so far is a key record */
+  std::vector<bool> keys() const {
+    std::vector<bool> keys;
+    const uint8_t* p = bytes.data();
+    const uint8_t* const end = p + bytes.size();
+    uint64_t v;
+    while (p < end && modbus_get_varint(&p, end, &v) && p < end) {
+      const bool key = (*p++ & MODBUS_PACKED_KEY) != 0;
+      keys.push_back(key);
+      if (key && modbus_get_varint(&p, end, &v))
+	p += v;
+      for (int i = 0; i < 3; i++)
+	modbus_get_varint(&p, end, &v);
+    }
+    return keys;
+  }
+};
+
+/* what a reader handed to apply */
+struct Applied {
+  object_handle handle;
+  ModbusRecord record;
+};
+
+struct Collect {
+  std::map<std::string, object_handle> handles;
+  std::vector<Applied> applied;
+
+  object_handle intern(const std::string& name) {
+    return handles.insert(std::make_pair(name, object_handle(handles.size()))).first->second;
+  }
+
+  void apply(const object_handle h, const ModbusRecord& r) {
+    const Applied a = {h, r};
+    applied.push_back(a);
+  }
+
+  PackedReader::Intern interner() { return std::bind(&Collect::intern, this, std::placeholders::_1); }
+  PackedReader::Apply applier() { return std::bind(&Collect::apply, this, std::placeholders::_1, std::placeholders::_2); }
+};
+
+static bool read(PackedReader& reader, Collect& c, const std::vector<uint8_t>& bytes, const double quantum) {
+  return reader.read(bytes.data(), bytes.data() + bytes.size(), 0.0, quantum, c.interner(), c.applier());
+}
+
+static void packed_round_trip() {
+  const double quantum = 1e-5;
+  const int bodies = 3, steps = 200;
+  const char* const names[bodies] = {"body[0]", "body[1]", "a body with a longer name than the others[2]"};
+  Packer writer(quantum);
+  PackedReader reader;
+  Collect c;
+  double perr = 0, rerr = 0;
+
+  for (int k = 0; k < steps; k++) {
+    writer.bytes.clear();
+    double p[3], m[9];
+    for (int i = 0; i < bodies; i++) {
+      position(i, k, p);
+      rotation(i, k, m);
+      CHECK(writer.record(i, names[i], MODBUS_OP_TRANSLATION, p));
+      CHECK(writer.record(i, names[i], MODBUS_OP_ROTATION_MATRIX, m));
+    }
+
+    c.applied.clear();
+    CHECK(read(reader, c, writer.bytes, quantum));
+    CHECK(c.applied.size() == std::size_t(2 * bodies));
+    for (std::size_t j = 0; j < c.applied.size(); j++) {
+      const Applied& a = c.applied[j];
+      const int i = a.record.reference;
+      CHECK(a.handle == c.handles[names[i]]);
+      if (a.record.op == MODBUS_OP_TRANSLATION) {
+	position(i, k, p);
+	CHECK(a.record.count == 3);
+	perr = std::max(perr, max_error(p, a.record.values, 3));
+      } else {
+	rotation(i, k, m);
+	CHECK(a.record.op == MODBUS_OP_ROTATION_MATRIX && a.record.count == 9);
+	rerr = std::max(rerr, max_error(m, a.record.values, 9));
+      }
+    }
+  }
+
+  CHECK(c.handles.size() == std::size_t(bodies));
+  CHECK(perr <= quantum / 2 + 1e-12);
+  CHECK(rerr < 1e-4);
+}
+
+static void packed_bad_bytes() {
+  double p[3] = {1, 2, 3};
+  Packer packer(1e-3);
+  packer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  packer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+
+  /* the first record is applied, the second ends too early */
+  std::vector<uint8_t> truncated(packer.bytes.begin(), packer.bytes.end() - 1);
+  PackedReader reader;
+  Collect c;
+  CHECK(!read(reader, c, truncated, 1e-3));
+  CHECK(c.applied.size() == 1);
+
+  /* reference numbers are bounded before anything is allocated for them */
+  Packer far(1e-3);
+  far.record(PackedReader::MAX_REFERENCES, "body", MODBUS_OP_TRANSLATION, p);
+  PackedReader fresh;
+  Collect d;
+  CHECK(!read(fresh, d, far.bytes, 1e-3));
+  CHECK(d.applied.empty() && d.handles.empty());
+
+  /* differences without a key are dropped */
+  Packer late(1e-3);
+  late.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  late.bytes.clear();
+  late.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  PackedReader other;
+  Collect e;
+  CHECK(read(other, e, late.bytes, 1e-3));
+  CHECK(e.applied.empty());
+}
+
+static void packed_renamed() {
+  double p[3] = {1, 2, 3}, m[9];
+  rotation(0, 0, m);
+  PackedReader reader;
+  Collect c;
+
+  Packer first(1e-3);
+  first.record(0, "a", MODBUS_OP_TRANSLATION, p);
+  first.record(0, "a", MODBUS_OP_ROTATION_MATRIX, m);
+  CHECK(read(reader, c, first.bytes, 1e-3));
+  CHECK(c.applied.size() == 2);
+
+  /* the number now stands for b, a difference to the rotation of a must not reach it */
+  Packer second(first);
+  second.bytes.clear();
+  second.sent[0].position_keys = 0;
+  second.record(0, "b", MODBUS_OP_TRANSLATION, p);
+  second.record(0, "b", MODBUS_OP_ROTATION_MATRIX, m);
+
+  c.applied.clear();
+  CHECK(read(reader, c, second.bytes, 1e-3));
+  CHECK(c.applied.size() == 1 && c.applied[0].handle == c.handles["b"]);
+}
+
+/* rotations about z, the dropped component is w up to a half turn and z after it */
+static void z_rotation(const double a, double* m) {
+  const double r[9] = {std::cos(a), -std::sin(a), 0, std::sin(a), std::cos(a), 0, 0, 0, 1};
+  std::memcpy(m, r, sizeof(r));
+}
+
+static void packed_keys() {
+  const double quantum = 1e-3;
+  double p[3] = {1, 2, 3}, m[9];
+
+  /* what is not a rotation or too far away goes in full */
+  Packer full(quantum);
+  const double scaled[9] = {2, 0, 0, 0, 2, 0, 0, 0, 2}, mirrored[9] = {1, 0, 0, 0, 1, 0, 0, 0, -1}, far[3] = {1e30, 0, 0};
+  CHECK(!full.record(0, "body", MODBUS_OP_ROTATION_MATRIX, scaled));
+  CHECK(!full.record(0, "body", MODBUS_OP_ROTATION_MATRIX, mirrored));
+  CHECK(!full.record(0, "body", MODBUS_OP_TRANSLATION, far));
+  CHECK(!full.record(0, "body", MODBUS_OP_SCALE, p));
+  CHECK(full.bytes.empty());
+
+  /* a key after the interval and when the dropped component changes */
+  Packer writer(quantum);
+  PackedReader reader;
+  Collect c;
+  for (int k = 0; k <= MODBUS_KEYFRAME_INTERVAL + 1; k++)
+    writer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  z_rotation(0.1, m);
+  writer.record(0, "body", MODBUS_OP_ROTATION_MATRIX, m);
+  z_rotation(0.2, m);
+  writer.record(0, "body", MODBUS_OP_ROTATION_MATRIX, m);
+  z_rotation(3.0, m);
+  writer.record(0, "body", MODBUS_OP_ROTATION_MATRIX, m);
+
+  std::vector<bool> keys = writer.keys();
+  CHECK(keys.size() == std::size_t(MODBUS_KEYFRAME_INTERVAL + 5));
+  for (std::size_t k = 0; k < keys.size(); k++) {
+    const bool key = k == 0 || k == std::size_t(MODBUS_KEYFRAME_INTERVAL + 1) ||
+      k == std::size_t(MODBUS_KEYFRAME_INTERVAL + 2) || k == std::size_t(MODBUS_KEYFRAME_INTERVAL + 4);
+    CHECK(keys[k] == key);
+  }
+  CHECK(read(reader, c, writer.bytes, quantum));
+  CHECK(!c.applied.empty() && max_error(m, c.applied.back().record.values, 9) < 1e-4);
+
+  /* after a frame got lost, the next one starts over with keys */
+  writer.bytes.clear();
+  p[0] = 5;
+  writer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  writer.bytes.clear();
+  writer.resync();
+  p[0] = 7;
+  writer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  writer.record(0, "body", MODBUS_OP_ROTATION_MATRIX, m);
+  keys = writer.keys();
+  CHECK(keys.size() == 2 && keys[0] && keys[1]);
+
+  c.applied.clear();
+  CHECK(read(reader, c, writer.bytes, quantum));
+  CHECK(c.applied.size() == 2 && max_error(p, c.applied[0].record.values, 3) <= quantum / 2);
+}
+
+static void packed_streams() {
+  void* context = proc3d_animation_context_new();
+  double p[3] = {1, 2, 3};
+  Packer writer(1e-3);
+  writer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  const std::vector<uint8_t> key = writer.bytes;
+  writer.bytes.clear();
+  writer.record(0, "body", MODBUS_OP_TRANSLATION, p);
+  const std::vector<uint8_t> delta = writer.bytes;
+
+  CHECK(proc3d_apply_packed(context, ":1.1", 1, 0.0, 1e-3, key.data(), key.size()) == 0);
+  const proc3d_handle h = proc3d_get_handle(context, "body");
+  CHECK(proc3d_object_ops(context, h) == 1);
+
+  /* the differences of another stream or sender are not relative to this key */
+  CHECK(proc3d_apply_packed(context, ":1.1", 2, 0.1, 1e-3, delta.data(), delta.size()) == 0);
+  CHECK(proc3d_apply_packed(context, ":1.2", 1, 0.1, 1e-3, delta.data(), delta.size()) == 0);
+  CHECK(proc3d_object_ops(context, h) == 1);
+
+  CHECK(proc3d_apply_packed(context, ":1.1", 1, 0.1, 1e-3, delta.data(), delta.size()) == 0);
+  CHECK(proc3d_object_ops(context, h) == 2);
+  proc3d_animation_context_free(context);
+}
+
+/* a ring segment, written by a thread with the writer functions of modbus_ring_add */
+class Ring {
+public:
+  Ring(const std::string& path, const uint32_t capacity, const std::size_t bytes, const uint32_t record_size)
+    : path(path), ring(NULL), size(bytes) {
+    const int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+      if (fd >= 0)
+	close(fd);
+      return;
+    }
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+      return;
+
+    ring = static_cast<ModbusRing*>(mem);
+    modbus_ring_init(ring, capacity);
+    ring->record_size = record_size;
+  }
+
+  ~Ring() {
+    if (ring)
+      munmap(ring, size);
+    shm_unlink(path.c_str());
+  }
+
+  /* the next free record, waits for the reader while the ring is full */
+  ModbusRecord* next() {
+    ModbusRecord* record;
+    while (!(record = modbus_ring_slot(ring, ring->head)))
+      std::this_thread::yield();
+    return record;
+  }
+
+  void publish() {
+    modbus_ring_store(&ring->head, ring->head + 1);
+  }
+
+  void put(const uint32_t reference, const int op, const double t, const double* values, const int n) {
+    modbus_ring_record(next(), reference, op, t, values, n);
+    publish();
+  }
+
+  void name(const uint32_t reference, const std::string& name) {
+    std::size_t sent = 0, n;
+    do {
+      n = modbus_ring_name(next(), reference, name.data(), name.size(), sent);
+      publish();
+      sent += n;
+    } while (n == MODBUS_RING_NAME_BYTES);
+  }
+
+  void close_ring() { modbus_ring_store(&ring->closed, 1u); }
+
+  const std::string path;
+  ModbusRing* ring;
+  std::size_t size;
+};
+
+static std::string ring_path(const char* what) {
+  char path[64];
+  std::snprintf(path, sizeof(path), "/m3d_wire_test_%s_%d", what, int(getpid()));
+  return path;
+}
+
+static void ring_round_trip() {
+  const uint32_t capacity = 16;
+  const int steps = 1000;
+  const std::string names[2] = {"body", std::string(100, 'x') + "[1]"};	// the second one spans two name records
+  Ring ring(ring_path("trip"), capacity, MODBUS_RING_BYTES(capacity), sizeof(ModbusRecord));
+  CHECK(ring.ring != NULL);
+  if (!ring.ring)
+    return;
+
+  RingReader reader(ring.path.c_str());
+  CHECK(reader.ok());
+  Collect c;
+  reader.start(c.interner(), c.applier());
+
+  std::thread writer([&ring, &names] () {
+      ring.name(0, names[0]);
+      ring.name(1, names[1]);
+      for (int k = 0; k < steps; k++) {
+	double p[3];
+	position(k % 2, k, p);
+	ring.put(k % 2, MODBUS_OP_TRANSLATION, k * DT, p, 3);
+
+	/* records the reader has to drop: too many values, a reference without a name */
+	if (k == steps / 2) {
+	  ModbusRecord* r = ring.next();
+	  modbus_ring_record(r, k % 2, MODBUS_OP_TRANSLATION, k * DT, p, 3);
+	  r->count = MODBUS_RECORD_VALUES + 1;
+	  ring.publish();
+	  ring.put(7, MODBUS_OP_TRANSLATION, k * DT, p, 3);
+	}
+      }
+      ring.close_ring();
+    });
+  writer.join();
+  reader.finish();
+
+  CHECK(c.handles.size() == 2 && c.handles.count(names[1]) == 1);
+  CHECK(c.applied.size() == std::size_t(steps));
+  for (std::size_t k = 0; k < c.applied.size(); k++) {
+    const Applied& a = c.applied[k];
+    double p[3];
+    position(k % 2, k, p);
+    CHECK(a.handle == c.handles[names[k % 2]]);
+    CHECK(a.record.t == k * DT && max_error(p, a.record.values, 3) == 0);
+  }
+}
+
+static void ring_bad_segments() {
+  /* a writer with another record layout */
+  Ring other(ring_path("layout"), 16, MODBUS_RING_BYTES(16), sizeof(ModbusRecord) + 8);
+  CHECK(!RingReader(other.path.c_str()).ok());
+
+  /* a capacity the segment does not hold */
+  Ring small(ring_path("small"), 1024, MODBUS_RING_BYTES(16), sizeof(ModbusRecord));
+  CHECK(!RingReader(small.path.c_str()).ok());
+
+  CHECK(!RingReader("/m3d_wire_test_missing").ok());
+}
+
+int main() {
+  packed_round_trip();
+  packed_bad_bytes();
+  packed_renamed();
+  packed_keys();
+  packed_streams();
+  ring_round_trip();
+  ring_bad_segments();
+
+  return finish();
+}